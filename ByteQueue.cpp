@@ -7,15 +7,116 @@ by Nicolas Ayllon
 */
 
 #include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <new>
+#include <vector>
+#include <chrono>
+#include <coroutine>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <cerrno>
+#include <csignal>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 // Classes
 class ByteQueueFragment;
 class FragmentPool;
+class ByteQueue;
+class ByteQueueIterator;
+class ByteQueueSpanIterator;
+class SpscByteQueue;
+class MpscByteQueue;
+class FragmentChannel;
+class EpochReclaimer;
+// A contiguous run of bytes inside one fragment
+struct ByteSpan {
+  unsigned char* data;
+  size_t len;
+};
+// One run of bytes for enqueue_scatter to add to a queue
+struct ScatterEntry {
+  ByteQueueFragment** queue;
+  const unsigned char* data;
+  size_t len;
+};
+// Returned by searches that find nothing
+const size_t npos = static_cast<size_t>(-1);
+// Returned by message reads when the length prefix is malformed
+const size_t malformed_message = static_cast<size_t>(-2);
+// Returned by message reads when the message is longer than the buffer
+const size_t message_too_long = static_cast<size_t>(-3);
 // Errors
-void on_out_of_memory() {
-  printf("[!] out of memory, no queue created\n");
+/*
+Errors are passed to a pluggable handler, by default one that prints them.
+Building with BYTEQUEUE_NO_STDIO makes the default handler silent, so no
+stdio is pulled in. The on_* functions are kept cold and out of line so
+they don't weigh down the hot paths that call them.
+*/
+enum class QueueError : uint8_t {
+  None,
+  OutOfMemory,
+  IllegalOperation,
+  OutOfRange,
+  ReadTooLong
+};
+
+typedef void (*QueueErrorHandler)(QueueError error);
+
+void print_error(QueueError error) {
+#ifndef BYTEQUEUE_NO_STDIO
+  if(error == QueueError::OutOfMemory) {
+    printf("[!] out of memory, no queue created\n");
+  }
+  if(error == QueueError::IllegalOperation) {
+    printf("[!] queue empty, no byte dequeued\n");
+  }
+  if(error == QueueError::OutOfRange) {
+    printf("[!] offset out of range, no byte read\n");
+  }
+  if(error == QueueError::ReadTooLong) {
+    printf("[!] read longer than the pool holds, no bytes read\n");
+  }
+#else
+  (void)error;
+#endif
+}
+
+QueueErrorHandler error_handler = print_error;
+
+// nullptr ignores errors
+void set_error_handler(QueueErrorHandler handler) {
+  error_handler = handler;
+}
+
+[[gnu::cold, gnu::noinline]] void on_out_of_memory() {
+  if(error_handler != nullptr) error_handler(QueueError::OutOfMemory);
 }
-void on_illegal_operation() {
-  printf("[!] queue empty, no byte dequeued\n");
+[[gnu::cold, gnu::noinline]] void on_illegal_operation() {
+  if(error_handler != nullptr) error_handler(QueueError::IllegalOperation);
+}
+[[gnu::cold, gnu::noinline]] void on_out_of_range() {
+  if(error_handler != nullptr) error_handler(QueueError::OutOfRange);
+}
+[[gnu::cold, gnu::noinline]] void on_read_too_long() {
+  if(error_handler != nullptr) error_handler(QueueError::ReadTooLong);
 }
 
 /***************************/
@@ -34,28 +135,66 @@ FragmentPool holds a 2048-byte data array (unsigned char data[2048]).
 It allocates and deallocates 32-byte chunks for ByteQueueFragments.
 64 fragments fit into the pool, enough for the assumed max of 64 queues.
 
-FragmentPool also stores a pointer to the head the free list of unallocated
-fragments, allowing for fast O(1) allocation.
+FragmentPool also stores the head of the free list of unallocated
+fragments, allowing for fast O(1) allocation. The head is swapped with 
+compare-and-swap, so threads can allocate and deallocate at once without
+a lock. It packs the head fragment's index (0xff if none) in the low byte
+and a tag in the upper bytes, bumped on every change, so a swap based on a
+stale head always fails. The free list's links are kept in an array of
+their own rather than in the free fragments, so a thread reading the link
+of a fragment another thread just took never races with its writes.
+
+A pool can also be constructed in memory shared between processes (see
+SharedQueue). Free list links are fragment indices rather than pointers,
+so they hold wherever each process maps the pool. Such a pool has no low
+free eventfd, as an fd number means nothing in the other process.
 */
 //
 class FragmentPool {
 
   public:
+    static const size_t kNumFragments = 64;
+    // Bytes all fragments hold, the most any queue can hold
+    static const size_t kByteCapacity = kNumFragments * 28;
     // construction and allocation
-    FragmentPool();
+    explicit FragmentPool(bool isProcessShared = false);
     ByteQueueFragment* allocate();
+    ByteQueueFragment* tryAllocate();
     void deallocate(void* ptr);
+    void deallocateChain(ByteQueueFragment* first, ByteQueueFragment* last);
+    ByteQueueFragment* allocateBatch(size_t n, size_t& allocated);
+    void deallocateBatch(ByteQueueFragment* first);
+    bool hasFreeFragment();
+    size_t getFreeCount();
+    // free list links, also for lists from allocateBatch()
+    ByteQueueFragment* getNextFree(ByteQueueFragment* fragment);
+    void setNextFree(ByteQueueFragment* fragment, ByteQueueFragment* next);
+    // Signals fd (an eventfd) when the free fragments drop below threshold.
+    // Ignored for a process-shared pool.
+    void setLowFreeEventFd(int fd, size_t threshold);
     // memory calculations
     char getIndexInPool(void* ptr);
     ByteQueueFragment* getPointerAtIndex(char idx);
+    bool isInPool(ByteQueueFragment* ptr);
     // erase
     void eraseFragment(void* ptr);
     void erasePool();
 
   private:
-    unsigned char data[2048];
+    void pushFree(ByteQueueFragment* first, ByteQueueFragment* last, 
+                  size_t count);
+    ByteQueueFragment* getFreeHeadFragment(uint32_t head);
+    uint32_t makeFreeHead(ByteQueueFragment* fragment, uint32_t oldHead);
+    void countTaken(size_t count);
+    alignas(64) unsigned char data[kNumFragments * 32];
     // bool used[64]; // testing only
-    ByteQueueFragment* nextFreeFragment;
+    // index of the next free fragment after each free fragment, -1 if none
+    std::atomic<char> nextFree[kNumFragments];
+    std::atomic<uint32_t> freeHead;
+    std::atomic<size_t> freeCount;
+    int lowFreeEventFd;
+    size_t lowFreeThreshold;
+    bool isProcessShared;
   // testing
   friend void printDataBlock();
 };
@@ -91,8 +230,12 @@ and 4 bytes for tracking.
     Note: -1 refers to no index. For example, the last fragment 
     in the queue has no next fragment, so N = -1.
 
-When not in use, the same memory acts as a free list, storing a pointer to 
-the next unallocated fragment.
+    Every fragment keeps its own f and b, so its bytes are f..b. Fragments
+    before the back are usually full (f = 0, b = 27), but splicing queues
+    together can leave gaps at either end of a fragment.
+
+When not in use, a fragment is on the pool's free list, whose links the
+pool keeps beside the fragments.
 */
 //
 class ByteQueueFragment {
@@ -105,10 +248,8 @@ class ByteQueueFragment {
     // ByteQueueFragment's constructor is private,
     // FragmentPool handles creation
     ByteQueueFragment() {};
-    // Use union to use the same 32-bytes to store queue data when used, 
-    // or as part of a free list when unused.
-    union {
-      // filled when used
+    // The 32 bytes of queue data, filled when used
+    struct {
       struct {
         char m_backFragmentIdx;   // 1 byte, range 0-63
         char m_nextFragmentIdx;   // 1 byte, range 0-63
@@ -116,8 +257,6 @@ class ByteQueueFragment {
         char m_backItemIdx;       // 1 byte, range 0-27
         unsigned char bytes[28];  // 28 bytes
       } whenUsed;
-      // when not used, points to next available memory
-      ByteQueueFragment* next;
     } chunk;
     // Get
     char getBackFragmentIdx();
@@ -137,20 +276,78 @@ class ByteQueueFragment {
     void incrementBackItemIdx();
     void clearBytes();
     void setByte(char idx, char byte);
+    // Shared between threads
+    char loadFrontItemIdx();
+    char loadBackItemIdx();
+    char loadNextFragmentIdx();
+    void publishFrontItemIdx(char frontItemIdx);
+    void publishBackItemIdx(char backItemIdx);
+    void publishNextFragmentIdx(char nextFragmentIdx);
+    char loadCommitCount();
+    void addCommitCount(char count);
+    // Spans
+    ByteSpan getSpan(char fromIdx, char toIdx);
+    ByteQueueFragment* popFront();
+    ByteQueueFragment* findFragmentAt(size_t& offset);
+    // Search
+    uint32_t getMatchMask(unsigned char value, char fromIdx);
+    bool matchesAt(char idx, const unsigned char* needle, size_t len,
+                   ByteQueueFragment* back);
     // Testing & state
     bool isEmpty();
+    bool isFrontItemLast();
     bool isFrontItemAtEnd();
     bool isBackItemAtEnd();
     bool isValidByteIndex(char idx);
     bool isValidFragmentIndex(char idx);
-    // Sets an unused fragment's memory pointing to next in free list
+    // Links an unused fragment of the static pool to the next in a free list
     void setNextFree(ByteQueueFragment* nextFragment);
+    ByteQueueFragment* getNextFree();
 
     // Operations
-    friend ByteQueueFragment* create_queue();
-    friend void enqueue_byte(ByteQueueFragment*& front, unsigned char byte);
+    friend ByteQueueFragment* try_create_queue();
+    friend QueueError enqueue_byte(ByteQueueFragment*& front, 
+                                   unsigned char byte);
+    friend bool try_dequeue_byte(ByteQueueFragment*& front, 
+                                 unsigned char& byte);
     friend unsigned char dequeue_byte(ByteQueueFragment*& front);
     friend void destroy_queue(ByteQueueFragment*& front);
+    friend size_t try_reserve_spans(ByteQueueFragment*& front, 
+                                    ByteSpan* spans, size_t maxSpans);
+    friend void commit(ByteQueueFragment*& front, size_t n);
+    friend size_t readable_spans(ByteQueueFragment* front, 
+                                 ByteSpan* spans, size_t maxSpans);
+    friend void splice(ByteQueueFragment*& front_a, 
+                       ByteQueueFragment*& front_b);
+    friend ByteQueueFragment* split(ByteQueueFragment*& front, size_t n);
+    friend size_t skip(ByteQueueFragment*& front, size_t n);
+    friend unsigned char at(ByteQueueFragment* front, size_t offset);
+    friend size_t copy_out(ByteQueueFragment* front, size_t offset, 
+                           size_t len, unsigned char* dst);
+    friend size_t find_byte(ByteQueueFragment* front, 
+                            unsigned char value, size_t start);
+    friend size_t find(ByteQueueFragment* front, const unsigned char* needle,
+                       size_t needleLen, size_t start);
+    friend bool queue_empty(ByteQueueFragment* front);
+    friend size_t queue_size(ByteQueueFragment* front);
+    friend size_t enqueue_capacity(ByteQueueFragment* front);
+    friend size_t reserve_bytes(ByteQueueFragment*& front, ByteSpan* spans,
+                                size_t len);
+    friend size_t enqueue_scatter(ScatterEntry* entries, size_t count);
+    friend void set_low_free_event_fd(int fd, size_t threshold);
+    template <typename T>
+    friend QueueError enqueue_uint(ByteQueueFragment*& front, 
+                                   T value, bool isBigEndian);
+    template <typename T>
+    friend bool try_dequeue_uint(ByteQueueFragment*& front, 
+                                 T& value, bool isBigEndian);
+    friend class ByteQueue;
+    friend class ByteQueueIterator;
+    friend class ByteQueueSpanIterator;
+    friend class SpscByteQueue;
+    friend class MpscByteQueue;
+    friend class FragmentChannel;
+    friend class EpochReclaimer;
     // Testing
     friend void printDataBlock();
 };
@@ -166,35 +363,51 @@ FragmentPool ByteQueueFragment::pool = FragmentPool();
 
 /* * * * * * * * Fragment Pool * * * * * * * */
 
-FragmentPool::FragmentPool() {
+FragmentPool::FragmentPool(bool isProcessShared)
+  : isProcessShared(isProcessShared) {
   erasePool();
   // memset(&used, false, 64); // (testing only) initialize used array
-  // Set each 32-byte unused memory chunks pointing to next in free list
+  // Link each fragment to the next in the free list
   size_t numFragments = sizeof(data) / sizeof(ByteQueueFragment);
   ByteQueueFragment* start = reinterpret_cast<ByteQueueFragment*>(&data);
-  ByteQueueFragment* fragment = start;
   for(int i = 1; i < numFragments; ++i) {
-    fragment[i-1].setNextFree(&fragment[i]);
+    nextFree[i-1].store(i, std::memory_order_relaxed);
   }
-  fragment[numFragments-1].setNextFree(nullptr);
-  nextFreeFragment = start;
+  nextFree[numFragments-1].store(-1, std::memory_order_relaxed);
+  freeHead.store(makeFreeHead(start, 0));
+  freeCount.store(numFragments);
+  lowFreeEventFd = -1;
+  lowFreeThreshold = 0;
 }
 
-ByteQueueFragment* FragmentPool::allocate() {
-  if(nextFreeFragment == nullptr) {
-    on_out_of_memory();
-    return nullptr;
+// Allocation doesn't report running out of memory
+ByteQueueFragment* FragmentPool::tryAllocate() {
+  uint32_t head = freeHead.load(std::memory_order_acquire);
+  ByteQueueFragment* freeFragment;
+  while(true) {
+    freeFragment = getFreeHeadFragment(head);
+    if(freeFragment == nullptr) return nullptr;
+    // Another thread may have taken freeFragment, then this link is
+    // stale, but the head has changed and the swap fails
+    ByteQueueFragment* next = getNextFree(freeFragment);
+    if(freeHead.compare_exchange_weak(head, makeFreeHead(next, head),
+                                      std::memory_order_acquire)) break;
   }
-  ByteQueueFragment* freeFragment = nextFreeFragment;
-  nextFreeFragment = nextFreeFragment->chunk.next;
+  countTaken(1);
   // used[getIndexInPool(freeFragment)] = true; // testing only
   return freeFragment;
 }
 
+ByteQueueFragment* FragmentPool::allocate() {
+  ByteQueueFragment* freeFragment = tryAllocate();
+  if(freeFragment == nullptr) on_out_of_memory();
+  return freeFragment;
+}
+
 void FragmentPool::deallocate(void* ptr) {
   eraseFragment(ptr);
-  reinterpret_cast<ByteQueueFragment*>(ptr)->setNextFree(nextFreeFragment);
-  nextFreeFragment = reinterpret_cast<ByteQueueFragment*>(ptr);
+  ByteQueueFragment* fragment = reinterpret_cast<ByteQueueFragment*>(ptr);
+  pushFree(fragment, fragment, 1);
   // used[getIndexInPool(ptr)] = false; // testing only
 }
 
@@ -210,6 +423,138 @@ ByteQueueFragment* FragmentPool::getPointerAtIndex(char idx) {
     + idx;
 }
 
+// Deallocates the fragments linked from first through last (or through the
+// end of the chain if last is nullptr), adding them to the free list at once.
+void FragmentPool::deallocateChain(ByteQueueFragment* first, 
+                                   ByteQueueFragment* last) {
+  ByteQueueFragment* fragment = first;
+  size_t count = 1;
+  while(true) {
+    char nextIdx = fragment == last ? -1 : fragment->getNextFragmentIdx();
+    eraseFragment(fragment);
+    if(nextIdx == -1) break;
+    ByteQueueFragment* next = getPointerAtIndex(nextIdx);
+    setNextFree(fragment, next);
+    fragment = next;
+    ++count;
+  }
+  pushFree(first, fragment, count);
+}
+
+// Takes up to n fragments off the free list in one step. They stay linked
+// as a free list, pop them with getNextFree() and return unused ones with
+// deallocateBatch().
+ByteQueueFragment* FragmentPool::allocateBatch(size_t n, size_t& allocated) {
+  uint32_t head = freeHead.load(std::memory_order_acquire);
+  ByteQueueFragment* first;
+  ByteQueueFragment* last;
+  while(true) {
+    first = getFreeHeadFragment(head);
+    last = nullptr;
+    allocated = 0;
+    ByteQueueFragment* next = first;
+    // As in tryAllocate(), links read here are checked by the swap
+    while(allocated < n && next != nullptr) {
+      last = next;
+      next = getNextFree(next);
+      ++allocated;
+    }
+    if(last == nullptr) return nullptr;
+    if(freeHead.compare_exchange_weak(head, makeFreeHead(next, head),
+                                      std::memory_order_acquire)) break;
+  }
+  setNextFree(last, nullptr);
+  countTaken(allocated);
+  return first;
+}
+
+// Returns a list from allocateBatch() to the free list
+void FragmentPool::deallocateBatch(ByteQueueFragment* first) {
+  if(first == nullptr) return;
+  ByteQueueFragment* last = first;
+  size_t count = 1;
+  while(getNextFree(last) != nullptr) {
+    last = getNextFree(last);
+    ++count;
+  }
+  pushFree(first, last, count);
+}
+
+bool FragmentPool::hasFreeFragment() {
+  return getFreeHeadFragment(freeHead.load(std::memory_order_relaxed)) 
+    != nullptr;
+}
+
+size_t FragmentPool::getFreeCount() {
+  return freeCount.load(std::memory_order_relaxed);
+}
+
+void FragmentPool::setLowFreeEventFd(int fd, size_t threshold) {
+  if(isProcessShared) return;
+  lowFreeEventFd = fd;
+  lowFreeThreshold = threshold;
+}
+
+// Updates the free count after count fragments were allocated, signaling
+// the low free eventfd if they took it below the threshold
+void FragmentPool::countTaken(size_t count) {
+  size_t before = freeCount.fetch_sub(count, std::memory_order_relaxed);
+  if(before < lowFreeThreshold || before - count >= lowFreeThreshold) return;
+#ifdef __linux__
+  if(lowFreeEventFd != -1) eventfd_write(lowFreeEventFd, 1);
+#endif
+}
+
+// Pushes a list of count free fragments linked from first to last
+// onto the free list with one compare-and-swap
+void FragmentPool::pushFree(ByteQueueFragment* first, ByteQueueFragment* last,
+                            size_t count) {
+  // Counted before the swap makes them takeable, so a thread taking them
+  // at once never subtracts them first: the count can briefly be above
+  // the fragments on the list, but never below, and never wraps
+  freeCount.fetch_add(count, std::memory_order_relaxed);
+  uint32_t head = freeHead.load(std::memory_order_relaxed);
+  do {
+    setNextFree(last, getFreeHeadFragment(head));
+  } while(!freeHead.compare_exchange_weak(head, makeFreeHead(first, head),
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+}
+
+ByteQueueFragment* FragmentPool::getFreeHeadFragment(uint32_t head) {
+  uint32_t idx = head & 0xff;
+  if(idx == 0xff) return nullptr;
+  return getPointerAtIndex(idx);
+}
+
+// The new head points to fragment, with the tag of the old head plus one
+uint32_t FragmentPool::makeFreeHead(ByteQueueFragment* fragment, 
+                                    uint32_t oldHead) {
+  uint32_t idx = fragment == nullptr ? 0xff : getIndexInPool(fragment);
+  return ((oldHead + 0x100) & ~uint32_t(0xff)) | idx;
+}
+
+// (Atomic since a thread allocating may read a link while another
+// writes it, see tryAllocate.)
+ByteQueueFragment* FragmentPool::getNextFree(ByteQueueFragment* fragment) {
+  char idx = nextFree[size_t(getIndexInPool(fragment))]
+    .load(std::memory_order_relaxed);
+  if(idx == -1) return nullptr;
+  return getPointerAtIndex(idx);
+}
+
+void FragmentPool::setNextFree(ByteQueueFragment* fragment,
+                               ByteQueueFragment* next) {
+  nextFree[size_t(getIndexInPool(fragment))].store(
+    next == nullptr ? -1 : getIndexInPool(next), std::memory_order_relaxed);
+}
+
+bool FragmentPool::isInPool(ByteQueueFragment* ptr) {
+  uintptr_t offset = 
+    reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(&data);
+  return offset < sizeof(data) && offset % sizeof(ByteQueueFragment) == 0;
+}
+
 void FragmentPool::eraseFragment(void* ptr) {
   memset(ptr, 0, sizeof(ByteQueueFragment));
 }
@@ -289,11 +634,183 @@ void ByteQueueFragment::setByte(char idx, char byte) {
   chunk.whenUsed.bytes[idx] = byte;
 }
 
+// Shared between threads
+// A thread that loads an index sees every write made before it was published
+char ByteQueueFragment::loadFrontItemIdx() {
+  return std::atomic_ref<char>(chunk.whenUsed.m_frontItemIdx)
+    .load(std::memory_order_acquire);
+}
+
+char ByteQueueFragment::loadBackItemIdx() {
+  return std::atomic_ref<char>(chunk.whenUsed.m_backItemIdx)
+    .load(std::memory_order_acquire);
+}
+
+char ByteQueueFragment::loadNextFragmentIdx() {
+  return std::atomic_ref<char>(chunk.whenUsed.m_nextFragmentIdx)
+    .load(std::memory_order_acquire);
+}
+
+void ByteQueueFragment::publishFrontItemIdx(char frontItemIdx) {
+  std::atomic_ref<char>(chunk.whenUsed.m_frontItemIdx)
+    .store(frontItemIdx, std::memory_order_release);
+}
+
+void ByteQueueFragment::publishBackItemIdx(char backItemIdx) {
+  std::atomic_ref<char>(chunk.whenUsed.m_backItemIdx)
+    .store(backItemIdx, std::memory_order_release);
+}
+
+void ByteQueueFragment::publishNextFragmentIdx(char nextFragmentIdx) {
+  std::atomic_ref<char>(chunk.whenUsed.m_nextFragmentIdx)
+    .store(nextFragmentIdx, std::memory_order_release);
+}
+
+// Fragments of an MpscByteQueue count the bytes written into them in B,
+// which they don't otherwise use
+char ByteQueueFragment::loadCommitCount() {
+  return std::atomic_ref<char>(chunk.whenUsed.m_backFragmentIdx)
+    .load(std::memory_order_acquire);
+}
+
+void ByteQueueFragment::addCommitCount(char count) {
+  std::atomic_ref<char>(chunk.whenUsed.m_backFragmentIdx)
+    .fetch_add(count, std::memory_order_release);
+}
+
+// Spans
+ByteSpan ByteQueueFragment::getSpan(char fromIdx, char toIdx) {
+  return ByteSpan{&chunk.whenUsed.bytes[size_t(fromIdx)],
+                  size_t(toIdx - fromIdx + 1)};
+}
+
+// Deallocates this front fragment and returns the new front,
+// or nullptr if this was the last fragment in the queue.
+ByteQueueFragment* ByteQueueFragment::popFront() {
+  ByteQueueFragment* newFront = getNextFragment();
+  if(newFront != nullptr) {
+    // Update the next fragment with front's data, and set it as the new front.
+    newFront->setBackFragmentIdx(getBackFragmentIdx());
+    // No need for setNextFragment() of next fragment. Unaffected by dequeue.
+    // No need for setFrontItemIdx() or setBackItemIdx(), each fragment
+    // already tracks its own.
+  }
+  ByteQueueFragment::pool.deallocate(this);
+  return newFront;
+}
+
+// Called on a front fragment. Finds the fragment holding the byte at 
+// offset from the front of the queue, stepping a whole fragment at a time,
+// and updates offset to that byte's index in the fragment's byte array.
+// Returns nullptr if the queue is shorter than offset + 1 bytes.
+// Queues span at most 64 fragments, so the walk is short.
+ByteQueueFragment* ByteQueueFragment::findFragmentAt(size_t& offset) {
+  if(isEmpty()) return nullptr;
+  ByteQueueFragment* back = getBackFragment();
+  ByteQueueFragment* fragment = this;
+  while(true) {
+    size_t count = fragment->getBackItemIdx() - fragment->getFrontItemIdx() + 1;
+    if(offset < count) break;
+    if(fragment == back) return nullptr;
+    offset -= count;
+    fragment = fragment->getNextFragment();
+  }
+  offset += fragment->getFrontItemIdx();
+  return fragment;
+}
+
+// Search
+/*
+A fragment is exactly 32 bytes, so a single AVX2 compare (or two SSE2 
+compares) checks all of it at once, tracking bytes included. The match
+mask has bit i + 4 set when byte i of the byte array equals the value.
+The best version is picked once, when the program starts.
+*/
+uint32_t chunk_match_mask_scalar(const unsigned char* chunk, 
+                                 unsigned char value) {
+  uint32_t mask = 0;
+  for(int i = 0; i < 32; ++i) {
+    mask |= uint32_t(chunk[i] == value) << i;
+  }
+  return mask;
+}
+
+#ifdef __SSE2__
+uint32_t chunk_match_mask_sse2(const unsigned char* chunk, 
+                               unsigned char value) {
+  __m128i target = _mm_set1_epi8(value);
+  __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk));
+  __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk + 16));
+  uint32_t lowMask = _mm_movemask_epi8(_mm_cmpeq_epi8(low, target));
+  uint32_t highMask = _mm_movemask_epi8(_mm_cmpeq_epi8(high, target));
+  return lowMask | highMask << 16;
+}
+
+__attribute__((target("avx2")))
+uint32_t chunk_match_mask_avx2(const unsigned char* chunk, 
+                               unsigned char value) {
+  __m256i target = _mm256_set1_epi8(value);
+  __m256i all = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(all, target));
+}
+#endif
+
+typedef uint32_t (*ChunkMatchMaskFn)(const unsigned char*, unsigned char);
+
+ChunkMatchMaskFn select_chunk_match_mask() {
+#ifdef __SSE2__
+  if(__builtin_cpu_supports("avx2")) return chunk_match_mask_avx2;
+  return chunk_match_mask_sse2;
+#else
+  return chunk_match_mask_scalar;
+#endif
+}
+
+const ChunkMatchMaskFn chunk_match_mask = select_chunk_match_mask();
+
+// Returns a mask with bit i set when byte i equals value, 
+// for the bytes from fromIdx through the back byte
+uint32_t ByteQueueFragment::getMatchMask(unsigned char value, char fromIdx) {
+  uint32_t mask = 
+    chunk_match_mask(reinterpret_cast<unsigned char*>(this), value) >> 4;
+  uint32_t inRange = ((2u << getBackItemIdx()) - 1) & ~((1u << fromIdx) - 1);
+  return mask & inRange;
+}
+
+// Checks if needle follows byte idx, continuing into the next fragments
+// as far as the back fragment
+bool ByteQueueFragment::matchesAt(char idx, const unsigned char* needle, 
+                                  size_t len, ByteQueueFragment* back) {
+  ByteQueueFragment* fragment = this;
+  char fromIdx = idx + 1;
+  while(len > 0) {
+    if(fromIdx > fragment->getBackItemIdx()) {
+      if(fragment == back) return false;
+      fragment = fragment->getNextFragment();
+      fromIdx = fragment->getFrontItemIdx();
+    }
+    size_t count = fragment->getBackItemIdx() - fromIdx + 1;
+    if(count > len) count = len;
+    unsigned char* bytes = &fragment->chunk.whenUsed.bytes[size_t(fromIdx)];
+    if(memcmp(bytes, needle, count) != 0) {
+      return false;
+    }
+    needle += count;
+    len -= count;
+    fromIdx += count;
+  }
+  return true;
+}
+
 // Testing & State
 bool ByteQueueFragment::isEmpty() {
   return getFrontItemIdx() == -1 || getBackItemIdx() < getFrontItemIdx();
 }
 
+bool ByteQueueFragment::isFrontItemLast() {
+  return getFrontItemIdx() == getBackItemIdx();
+}
+
 bool ByteQueueFragment::isFrontItemAtEnd() {
   return getFrontItemIdx() == sizeof(chunk.whenUsed.bytes) - 1; // == 27
 }
@@ -319,9 +836,13 @@ bool ByteQueueFragment::isValidFragmentIndex(char idx) {
 }
 
 
-// For using the same memory in the free list
+// For free lists of the static pool
 void ByteQueueFragment::setNextFree(ByteQueueFragment* nextFragment) {
-  chunk.next = nextFragment;
+  ByteQueueFragment::pool.setNextFree(this, nextFragment);
+}
+
+ByteQueueFragment* ByteQueueFragment::getNextFree() {
+  return ByteQueueFragment::pool.getNextFree(this);
 }
 
 
@@ -329,9 +850,10 @@ void ByteQueueFragment::setNextFree(ByteQueueFragment* nextFragment) {
 /* * * * * * * * * * Operations * * * * * * * * * */
 /* * * * * * * * (Friend Functions) * * * * * * * */
 
-ByteQueueFragment* create_queue() {
+// Doesn't report running out of memory
+ByteQueueFragment* try_create_queue() {
   // Allocate memory
-  ByteQueueFragment* newFragment = ByteQueueFragment::pool.allocate();
+  ByteQueueFragment* newFragment = ByteQueueFragment::pool.tryAllocate();
   if(newFragment == nullptr) { 
     return nullptr; 
   }
@@ -345,22 +867,31 @@ ByteQueueFragment* create_queue() {
   return newFragment;
 }
 
+ByteQueueFragment* create_queue() {
+  ByteQueueFragment* front = try_create_queue();
+  if(front == nullptr) on_out_of_memory();
+  return front;
+}
+
 
 // Pass by reference to update front in case it was nullptr and got allocated
-void enqueue_byte(ByteQueueFragment*& front, unsigned char byte) {
+// Returns QueueError::OutOfMemory if a fragment was needed but the pool
+// has none left, the byte is not enqueued.
+QueueError enqueue_byte(ByteQueueFragment*& front, unsigned char byte) {
   // If front points to no queue (it's been deallocated)
   if(front == nullptr) {
     // First try to create it.
     front = create_queue();
     // If there really is no more memory, give up.
-    if(front == nullptr) return;
+    if(front == nullptr) return QueueError::OutOfMemory;
   }
 
   ByteQueueFragment* currentBack = front->getBackFragment();
   // If back fragment has last byte at end of array, allocate new fragment
   if(currentBack->isBackItemAtEnd()) {
     ByteQueueFragment* newBack = ByteQueueFragment::pool.allocate();
-    if(newBack == nullptr) return; // avoid crash for failed allocation
+    // avoid crash for failed allocation
+    if(newBack == nullptr) return QueueError::OutOfMemory;
     // Update indices in front and old back to point to new back
     char newBackFragmentIdx = 
       ByteQueueFragment::pool.getIndexInPool(newBack);
@@ -369,22 +900,23 @@ void enqueue_byte(ByteQueueFragment*& front, unsigned char byte) {
     // Initialize new back fragment
     newBack->setBackFragmentIdx(-1);
     newBack->setNextFragmentIdx(-1);
-    newBack->setFrontItemIdx(-1);
+    newBack->setFrontItemIdx(0);
     newBack->setBackItemIdx(0); // first item in the new back fragment
     newBack->clearBytes();
     newBack->setByte(0, byte);
-    return;
+    return QueueError::None;
   }
   // Front fragment empty, so set byte at index 0, update frontItem & backItem
   if(front->getFrontItemIdx() == -1) {
     front->setFrontItemIdx(0);
     front->setBackItemIdx(0);
     front->setByte(0, byte);
-    return;
+    return QueueError::None;
   }
   // Current back fragment is not empty
   currentBack->incrementBackItemIdx(); // -1 -> 0 in empty fragment
   currentBack->setByte(currentBack->getBackItemIdx(), byte);
+  return QueueError::None;
 }
 
 
@@ -394,99 +926,3899 @@ void enqueue_byte(ByteQueueFragment*& front, unsigned char byte) {
 // enqueue_byte will reallocate memory if bytes are added to the empty queue.
 //
 // (Pass by reference to update front when last byte in fragment is dequeued.)
-unsigned char dequeue_byte(ByteQueueFragment*& front) {
+//
+// Returns false without reporting an error if the queue is empty.
+bool try_dequeue_byte(ByteQueueFragment*& front, unsigned char& byte) {
   // Handle nullptr or empty queue
-  if(front == nullptr || front->isEmpty()) {
-    on_illegal_operation();
-    return 0;
-  }
-  unsigned char dequeuedByte = front->getFrontByte();
+  if(front == nullptr || front->isEmpty()) return false;
+  byte = front->getFrontByte();
   // Dequeued byte was the last in the fragment
-  if(front->isFrontItemAtEnd()) {
-    // There is no next fragment.
-    // Deallocate. A new one will be allocated on next enqueue.
-    if(front->getNextFragmentIdx() == -1) {
-      ByteQueueFragment::pool.deallocate(front);
-      front = nullptr;
-    }
-    // There is a next fragment.
-    // Update the next fragment with front's data, and set it as the new front.
-    else { 
-      ByteQueueFragment* newFront = front->getNextFragment();
-      newFront->setBackFragmentIdx(front->getBackFragmentIdx());
-      // No need for setNextFragment() of next fragment. Unaffected by dequeue.
-      newFront->setFrontItemIdx(0);
-      // No need for setBackItemIdx(), done in enqueue_byte
-      ByteQueueFragment::pool.deallocate(front);
-      front = newFront;
-    }
-    return dequeuedByte;
+  if(front->isFrontItemLast()) {
+    // If there is no next fragment, front becomes nullptr and
+    // a new one will be allocated on next enqueue.
+    front = front->popFront();
+    return true;
   }
 
   // Dequeued byte was NOT the last item in fragment, so increment index
   front->incrementFrontItemIdx();
-  // If the queue is now empty, deallocate it.
-  if(front->isEmpty()) {
-    ByteQueueFragment::pool.deallocate(front);
-    front = nullptr;
+  return true;
+}
+
+// Reports an illegal operation and returns 0 if the queue is empty
+unsigned char dequeue_byte(ByteQueueFragment*& front) {
+  unsigned char dequeuedByte;
+  if(!try_dequeue_byte(front, dequeuedByte)) {
+    on_illegal_operation();
+    return 0;
   }
   return dequeuedByte;
 }
 
 // Pass by reference to update front to nullptr once queue is destroyed
 void destroy_queue(ByteQueueFragment*& front) {
-  while(front != nullptr) {
-    ByteQueueFragment* fragmentToDeallocate = front;
-    front = front->getNextFragment();
-    ByteQueueFragment::pool.deallocate(fragmentToDeallocate);
+  if(front == nullptr) return;
+  ByteQueueFragment::pool.deallocateChain(front, nullptr);
+  front = nullptr;
+}
+
+// Appends queue b onto the back of queue a in O(1) by linking a's back 
+// fragment to b's front fragment. If b's front fragment fits in the space
+// left in a's back fragment, it is copied over instead to save a fragment.
+// Otherwise the space is left as a gap. 
+// (Pass by reference since b becomes empty, front_b = nullptr.)
+void splice(ByteQueueFragment*& front_a, ByteQueueFragment*& front_b) {
+  if(front_a == front_b || front_b == nullptr) return;
+  if(front_b->isEmpty()) {
+    destroy_queue(front_b);
+    return;
+  }
+  // Nothing to append onto, queue b becomes queue a
+  if(front_a == nullptr || front_a->isEmpty()) {
+    destroy_queue(front_a);
+    front_a = front_b;
+    front_b = nullptr;
+    return;
+  }
+  ByteQueueFragment* backA = front_a->getBackFragment();
+  ByteQueueFragment* linked = front_b;
+  size_t count = front_b->getBackItemIdx() - front_b->getFrontItemIdx() + 1;
+  size_t room = 27 - backA->getBackItemIdx();
+  // Compact b's front fragment into a's back fragment
+  if(count <= room) {
+    memcpy(&backA->chunk.whenUsed.bytes[backA->getBackItemIdx() + 1],
+           &front_b->chunk.whenUsed.bytes[size_t(front_b->getFrontItemIdx())], 
+           count);
+    backA->setBackItemIdx(backA->getBackItemIdx() + count);
+    linked = front_b->getNextFragment();
+    if(linked == nullptr) {
+      ByteQueueFragment::pool.deallocate(front_b);
+      front_b = nullptr;
+      return;
+    }
+  }
+  backA->setNextFragmentIdx(ByteQueueFragment::pool.getIndexInPool(linked));
+  front_a->setBackFragmentIdx(front_b->getBackFragmentIdx());
+  // Only the front fragment tracks the back fragment
+  if(linked == front_b) {
+    front_b->setBackFragmentIdx(-1);
+  } 
+  else {
+    ByteQueueFragment::pool.deallocate(front_b);
   }
+  front_b = nullptr;
 }
 
+// Cuts the first n bytes off the queue and returns them as a new queue.
+// Whole fragments are moved over as they are. If the cut falls inside a 
+// fragment, the smaller side of it is copied into a new fragment.
+// If n is at least the queue's size, the whole queue is returned.
+// Returns nullptr for n = 0, or if the copy could not be allocated.
+// (Pass by reference to update front, which loses the first n bytes.)
+ByteQueueFragment* split(ByteQueueFragment*& front, size_t n) {
+  if(n == 0 || front == nullptr || front->isEmpty()) return nullptr;
+  // Find the fragment holding the last byte of the new queue
+  ByteQueueFragment* back = front->getBackFragment();
+  ByteQueueFragment* prev = nullptr;
+  ByteQueueFragment* fragment = front;
+  size_t count = fragment->getBackItemIdx() - fragment->getFrontItemIdx() + 1;
+  while(n > count && fragment != back) {
+    n -= count;
+    prev = fragment;
+    fragment = fragment->getNextFragment();
+    count = fragment->getBackItemIdx() - fragment->getFrontItemIdx() + 1;
+  }
+  ByteQueueFragment* head = front;
+  // Cut falls after the fragment, no copy needed
+  if(n >= count) {
+    front = fragment->getNextFragment();
+    if(front != nullptr) {
+      front->setBackFragmentIdx(head->getBackFragmentIdx());
+      head->setBackFragmentIdx(
+        ByteQueueFragment::pool.getIndexInPool(fragment));
+      fragment->setNextFragmentIdx(-1);
+    }
+    return head;
+  }
+  ByteQueueFragment* copy = ByteQueueFragment::pool.allocate();
+  if(copy == nullptr) return nullptr;
+  char copyIdx = ByteQueueFragment::pool.getIndexInPool(copy);
+  char fragmentIdx = ByteQueueFragment::pool.getIndexInPool(fragment);
+  char frontItemIdx = fragment->getFrontItemIdx();
+  copy->setBackFragmentIdx(-1);
+  copy->setFrontItemIdx(0);
+  copy->clearBytes();
+  // Copy the first n bytes of the fragment, it becomes the new back of head
+  if(n <= count - n) {
+    memcpy(copy->chunk.whenUsed.bytes, 
+           &fragment->chunk.whenUsed.bytes[size_t(frontItemIdx)], n);
+    copy->setNextFragmentIdx(-1);
+    copy->setBackItemIdx(n - 1);
+    fragment->setFrontItemIdx(frontItemIdx + n);
+    // The fragment becomes the new front of the queue
+    if(fragment != front) {
+      fragment->setBackFragmentIdx(front->getBackFragmentIdx());
+    }
+    if(prev == nullptr) {
+      head = copy;
+    } 
+    else {
+      prev->setNextFragmentIdx(copyIdx);
+    }
+    head->setBackFragmentIdx(copyIdx);
+    front = fragment;
+    return head;
+  }
+  // Copy the rest of the fragment, it becomes the new front of the queue
+  memcpy(copy->chunk.whenUsed.bytes, 
+         &fragment->chunk.whenUsed.bytes[frontItemIdx + n], count - n);
+  copy->setNextFragmentIdx(fragment->getNextFragmentIdx());
+  copy->setBackItemIdx(count - n - 1);
+  copy->setBackFragmentIdx(fragment == back ? copyIdx 
+                                            : front->getBackFragmentIdx());
+  fragment->setBackItemIdx(frontItemIdx + n - 1);
+  fragment->setNextFragmentIdx(-1);
+  head->setBackFragmentIdx(fragmentIdx);
+  front = copy;
+  return head;
+}
 
+// Drops up to n bytes from the front of the queue, returns number dropped.
+// Whole fragments are skipped at a time and released to the pool together,
+// so this runs in O(fragments) rather than O(bytes).
+// (Pass by reference to update front when fragments are deallocated.)
+size_t skip(ByteQueueFragment*& front, size_t n) {
+  if(n == 0 || front == nullptr || front->isEmpty()) return 0;
+  ByteQueueFragment* back = front->getBackFragment();
+  ByteQueueFragment* fragment = front;
+  ByteQueueFragment* lastReleased = nullptr;
+  size_t skipped = 0;
+  // Walk past the fragments that are dropped entirely
+  while(fragment != nullptr) {
+    size_t count = fragment->getBackItemIdx() - fragment->getFrontItemIdx() + 1;
+    if(n - skipped < count) break;
+    skipped += count;
+    lastReleased = fragment;
+    fragment = fragment == back ? nullptr : fragment->getNextFragment();
+  }
+  if(lastReleased != nullptr) {
+    if(fragment != nullptr) {
+      fragment->setBackFragmentIdx(front->getBackFragmentIdx());
+    }
+    ByteQueueFragment::pool.deallocateChain(front, lastReleased);
+    front = fragment;
+  }
+  // Drop the rest from the new front fragment
+  if(front != nullptr && skipped < n) {
+    front->setFrontItemIdx(front->getFrontItemIdx() + (n - skipped));
+    skipped = n;
+  }
+  return skipped;
+}
 
-/*****************/
-/* T E S T I N G */ 
-/*****************/
+// Moves the first n bytes of queue a onto the back of queue b, relinking
+// whole fragments and copying only a partial one at either end. 
+// If n is at least the size of queue a, all of it is moved.
+QueueError transfer(ByteQueueFragment*& front_a, ByteQueueFragment*& front_b,
+                    size_t n) {
+  if(n == 0 || queue_empty(front_a)) return QueueError::None;
+  ByteQueueFragment* moved = split(front_a, n);
+  if(moved == nullptr) return QueueError::OutOfMemory;
+  splice(front_b, moved);
+  return QueueError::None;
+}
 
-void printDataBlock() {
-  // print j values
-  std::cout << "       j:";
-  for(int j = 0; j < 32; ++j) { printf("%4i", j); }
-  std::cout << '\n';
-  // print box top
-  std::cout << "        ┌─";
-  for(int j = 0; j < 32; ++j) { printf("────"); }
-  std::cout << '\n';
-  // print i labels
-  for(int i = 0; i < 64; ++i) {
-    // bool used = ByteQueueFragment::pool.used[i];
-    // std::string icon = used ? "●" : "○";
-    // printf("%s  i:%3i│", &icon, i);
-    bool used = true;       // when used array is commented out
-    printf("   i:%3i│", i); // when used array is commented out
-    // print bytes in row i
-    if(used) {
-      for(int j = 0; j < 32; ++j) {
-        unsigned char val = ByteQueueFragment::pool.data[32*i + j];
-        if(j < 4) {
-          printf("%4i", (char)val);
-          continue;
-        }
-        printf("%4i", val);
+// Returns the byte at offset from the front without removing it.
+// Reports an offset out of range and returns 0 if the queue is shorter.
+unsigned char at(ByteQueueFragment* front, size_t offset) {
+  ByteQueueFragment* fragment = 
+    front == nullptr ? nullptr : front->findFragmentAt(offset);
+  if(fragment == nullptr) {
+    on_out_of_range();
+    return 0;
+  }
+  return fragment->getByte(offset);
+}
+
+// Copies up to len bytes starting at offset from the front into dst,
+// without removing them. Returns the number of bytes copied.
+size_t copy_out(ByteQueueFragment* front, size_t offset, 
+                size_t len, unsigned char* dst) {
+  if(front == nullptr || len == 0) return 0;
+  ByteQueueFragment* fragment = front->findFragmentAt(offset);
+  if(fragment == nullptr) return 0;
+  ByteQueueFragment* back = front->getBackFragment();
+  char fromIdx = offset;
+  size_t copied = 0;
+  while(true) {
+    size_t count = fragment->getBackItemIdx() - fromIdx + 1;
+    if(count > len - copied) count = len - copied;
+    memcpy(dst + copied, &fragment->chunk.whenUsed.bytes[size_t(fromIdx)],
+           count);
+    copied += count;
+    if(copied == len || fragment == back) break;
+    fragment = fragment->getNextFragment();
+    fromIdx = fragment->getFrontItemIdx();
+  }
+  return copied;
+}
+
+// Returns the offset from the front of the first occurrence of needle,
+// searching from offset start, or npos if there is none. 
+// Matches may span fragments. An empty needle is never found.
+size_t find(ByteQueueFragment* front, const unsigned char* needle,
+            size_t needleLen, size_t start) {
+  if(front == nullptr || needleLen == 0) return npos;
+  size_t offset = start;
+  ByteQueueFragment* fragment = front->findFragmentAt(offset);
+  if(fragment == nullptr) return npos;
+  ByteQueueFragment* back = front->getBackFragment();
+  char fromIdx = offset;
+  // Offset from the front of the byte at fromIdx
+  size_t position = start;
+  while(true) {
+    // Candidates are the bytes that match the start of the needle
+    uint32_t candidates = fragment->getMatchMask(needle[0], fromIdx);
+    while(candidates != 0) {
+      char idx = __builtin_ctz(candidates);
+      if(fragment->matchesAt(idx, needle + 1, needleLen - 1, back)) {
+        return position + (idx - fromIdx);
       }
+      candidates &= candidates - 1;
     }
-    else {
-      for(int j = 0; j < 32; ++j) {
-        unsigned char val = ByteQueueFragment::pool.data[32*i + j];
-        printf("%4x", val);
+    if(fragment == back) return npos;
+    position += fragment->getBackItemIdx() - fromIdx + 1;
+    fragment = fragment->getNextFragment();
+    fromIdx = fragment->getFrontItemIdx();
+  }
+}
+
+// Returns the offset from the front of the first byte equal to value, 
+// searching from offset start, or npos if there is none
+size_t find_byte(ByteQueueFragment* front, unsigned char value, 
+                 size_t start) {
+  return find(front, &value, 1, start);
+}
+
+bool queue_empty(ByteQueueFragment* front) {
+  return front == nullptr || front->isEmpty();
+}
+
+// Returns the number of bytes in the queue, in O(fragments)
+size_t queue_size(ByteQueueFragment* front) {
+  if(front == nullptr || front->isEmpty()) return 0;
+  ByteQueueFragment* back = front->getBackFragment();
+  size_t size = 0;
+  for(ByteQueueFragment* fragment = front; ; 
+      fragment = fragment->getNextFragment()) {
+    size += fragment->getBackItemIdx() - fragment->getFrontItemIdx() + 1;
+    if(fragment == back) return size;
+  }
+}
+
+// Returns how many more bytes fit in the queue before the pool runs out: 
+// the space left in its back fragment plus all free fragments
+size_t enqueue_capacity(ByteQueueFragment* front) {
+  size_t capacity = 28 * ByteQueueFragment::pool.getFreeCount();
+  if(front != nullptr) {
+    capacity += 27 - front->getBackFragment()->getBackItemIdx();
+  }
+  return capacity;
+}
+
+
+/* * * * * * * * * * * Spans * * * * * * * * * * */
+/* * * * * * * * (Zero-Copy Access) * * * * * * * */
+
+// Note:
+// reserve_spans and commit work as a pair, like a two-phase enqueue.
+// reserve_spans hands out writable memory: first the free space at the end
+// of the back fragment, then fresh fragments linked after it. The fresh
+// fragments are not part of the queue yet (front's back index still points
+// to the old back) until commit() fills them. Unused ones are released.
+// Don't call other operations on the queue in between.
+//
+// (Pass by reference to update front in case it was nullptr and got allocated)
+//
+// Doesn't report running out of memory, for callers that take a full pool
+// as backpressure
+size_t try_reserve_spans(ByteQueueFragment*& front, 
+                         ByteSpan* spans, size_t maxSpans) {
+  if(maxSpans == 0) return 0;
+  if(front == nullptr) {
+    front = try_create_queue();
+    if(front == nullptr) return 0;
+  }
+  size_t numSpans = 0;
+  ByteQueueFragment* fragment = front->getBackFragment();
+  // Free space at the end of the back fragment comes first
+  if(!fragment->isBackItemAtEnd()) {
+    spans[numSpans++] = fragment->getSpan(fragment->getBackItemIdx() + 1, 27);
+  }
+  while(numSpans < maxSpans) {
+    ByteQueueFragment* newFragment = ByteQueueFragment::pool.tryAllocate();
+    if(newFragment == nullptr) break;
+    // Initialize like a new back fragment with no bytes yet
+    newFragment->setBackFragmentIdx(-1);
+    newFragment->setNextFragmentIdx(-1);
+    newFragment->setFrontItemIdx(-1);
+    newFragment->setBackItemIdx(-1);
+    fragment->setNextFragmentIdx(
+      ByteQueueFragment::pool.getIndexInPool(newFragment));
+    fragment = newFragment;
+    spans[numSpans++] = newFragment->getSpan(0, 27);
+  }
+  return numSpans;
+}
+
+// Reports running out of memory if nothing at all could be reserved
+size_t reserve_spans(ByteQueueFragment*& front, 
+                     ByteSpan* spans, size_t maxSpans) {
+  size_t numSpans = try_reserve_spans(front, spans, maxSpans);
+  if(numSpans == 0 && maxSpans > 0) on_out_of_memory();
+  return numSpans;
+}
+
+// Adds the first n reserved bytes to the queue and releases the rest
+void commit(ByteQueueFragment*& front, size_t n) {
+  if(front == nullptr) return;
+  ByteQueueFragment* fragment = front->getBackFragment();
+  ByteQueueFragment* lastFilled = fragment;
+  while(n > 0 && fragment != nullptr) {
+    size_t room = 27 - fragment->getBackItemIdx();
+    size_t count = n < room ? n : room;
+    if(count > 0) {
+      // New queue or reserved fragment has no front item yet
+      if(fragment->getFrontItemIdx() == -1) {
+        fragment->setFrontItemIdx(0);
       }
+      fragment->setBackItemIdx(fragment->getBackItemIdx() + count);
+      lastFilled = fragment;
+    }
+    n -= count;
+    fragment = fragment->getNextFragment();
+  }
+  front->setBackFragmentIdx(
+    ByteQueueFragment::pool.getIndexInPool(lastFilled));
+  // Release reserved fragments that received no bytes
+  ByteQueueFragment* unused = lastFilled->getNextFragment();
+  lastFilled->setNextFragmentIdx(-1);
+  if(unused != nullptr) {
+    ByteQueueFragment::pool.deallocateChain(unused, nullptr);
+  }
+}
+
+// Spans for any number of bytes the pool can hold: the back fragment's
+// free space plus every fragment in the pool
+const size_t kMaxReservedSpans = FragmentPool::kNumFragments + 1;
+
+// Reserves spans for exactly len (> 0) more bytes, like reserve_spans.
+// All or nothing: the pool is shared, so other threads may take the free
+// fragments after enqueue_capacity() was checked. If it runs out, the
+// fragments reserved so far are released and 0 is returned, unreported.
+size_t reserve_bytes(ByteQueueFragment*& front, ByteSpan* spans,
+                     size_t len) {
+  bool isNew = front == nullptr;
+  size_t room = isNew ? 0 : 27 - front->getBackFragment()->getBackItemIdx();
+  size_t numNeeded = len <= room ? 1 : (room > 0) + (len - room + 27) / 28;
+  if(numNeeded > kMaxReservedSpans) return 0;
+  size_t numSpans = try_reserve_spans(front, spans, numNeeded);
+  if(numSpans == numNeeded) return numSpans;
+  commit(front, 0);
+  if(isNew) destroy_queue(front);
+  return 0;
+}
+
+// Copies len bytes from data into reserved spans, from offset bytes in
+void copy_to_spans(ByteSpan* spans, size_t offset, 
+                   const unsigned char* data, size_t len) {
+  for(; len > 0; ++spans) {
+    if(offset >= spans->len) {
+      offset -= spans->len;
+      continue;
+    }
+    size_t count = spans->len - offset < len ? spans->len - offset : len;
+    memcpy(spans->data + offset, data, count);
+    offset = 0;
+    data += count;
+    len -= count;
+  }
+}
+
+// Like enqueue_bytes, but doesn't report running out of memory
+QueueError try_enqueue_bytes(ByteQueueFragment*& front, 
+                             const unsigned char* data, size_t len) {
+  if(len == 0) return QueueError::None;
+  if(enqueue_capacity(front) < len) return QueueError::OutOfMemory;
+  ByteSpan spans[kMaxReservedSpans];
+  if(reserve_bytes(front, spans, len) == 0) return QueueError::OutOfMemory;
+  copy_to_spans(spans, 0, data, len);
+  commit(front, len);
+  return QueueError::None;
+}
+
+// Enqueues len bytes from data, copying a fragment at a time.
+// Either all bytes are enqueued or, if the pool doesn't have enough free
+// fragments, none are and QueueError::OutOfMemory is returned.
+QueueError enqueue_bytes(ByteQueueFragment*& front, 
+                         const unsigned char* data, size_t len) {
+  QueueError error = try_enqueue_bytes(front, data, len);
+  if(error != QueueError::None) on_out_of_memory();
+  return error;
+}
+
+// Enqueues each entry's bytes onto its queue, in order, in one pass.
+// The fragments for the whole batch are taken off the free list at once,
+// and the next entry's back fragment and data are prefetched while the
+// current one is copied. Stops at the first entry that doesn't fit in
+// the pool, leaving it and the rest untouched. 
+// Returns the number of entries enqueued.
+size_t enqueue_scatter(ScatterEntry* entries, size_t count) {
+  // One fragment per 28 bytes that don't fit in the queue's back fragment
+  size_t needed = 0;
+  for(size_t i = 0; i < count; ++i) {
+    size_t room = 0;
+    if(*entries[i].queue != nullptr) {
+      room = 27 - (*entries[i].queue)->getBackFragment()->getBackItemIdx();
+    }
+    if(entries[i].len > room) needed += (entries[i].len - room + 27) / 28;
+  }
+  size_t available;
+  ByteQueueFragment* supply = 
+    ByteQueueFragment::pool.allocateBatch(needed, available);
+  size_t done = 0;
+  for(; done < count; ++done) {
+    ScatterEntry& entry = entries[done];
+    if(done + 1 < count) {
+      ByteQueueFragment* nextFront = *entries[done + 1].queue;
+      if(nextFront != nullptr) {
+        __builtin_prefetch(nextFront->getBackFragment(), 1);
+      }
+      __builtin_prefetch(entries[done + 1].data);
+    }
+    ByteQueueFragment*& front = *entry.queue;
+    // Check the entry fits before touching the queue
+    size_t room = 28 * available;
+    if(front != nullptr) {
+      room += 27 - front->getBackFragment()->getBackItemIdx();
+    }
+    if(room < entry.len) {
+      // Earlier entries for the same queue took the room counted for it
+      size_t extra;
+      ByteQueueFragment* more = ByteQueueFragment::pool.allocateBatch(
+        (entry.len - room + 27) / 28, extra);
+      if(more == nullptr) break;
+      ByteQueueFragment* last = more;
+      while(last->getNextFree() != nullptr) last = last->getNextFree();
+      last->setNextFree(supply);
+      supply = more;
+      available += extra;
+      room += 28 * extra;
+      if(room < entry.len) break;
+    }
+    if(entry.len == 0) continue;
+    if(front == nullptr) {
+      front = supply;
+      supply = supply->getNextFree();
+      --available;
+      front->setBackFragmentIdx(ByteQueueFragment::pool.getIndexInPool(front));
+      front->setNextFragmentIdx(-1);
+      front->setFrontItemIdx(-1);
+      front->setBackItemIdx(-1);
+    }
+    ByteQueueFragment* back = front->getBackFragment();
+    const unsigned char* data = entry.data;
+    size_t remaining = entry.len;
+    while(remaining > 0) {
+      if(back->isBackItemAtEnd()) {
+        ByteQueueFragment* newBack = supply;
+        supply = supply->getNextFree();
+        --available;
+        char newBackIdx = ByteQueueFragment::pool.getIndexInPool(newBack);
+        newBack->setBackFragmentIdx(-1);
+        newBack->setNextFragmentIdx(-1);
+        newBack->setFrontItemIdx(0);
+        newBack->setBackItemIdx(-1);
+        back->setNextFragmentIdx(newBackIdx);
+        front->setBackFragmentIdx(newBackIdx);
+        back = newBack;
+      }
+      char backItemIdx = back->getBackItemIdx();
+      size_t room = 27 - backItemIdx;
+      size_t n = remaining < room ? remaining : room;
+      memcpy(&back->chunk.whenUsed.bytes[backItemIdx + 1], data, n);
+      if(back->getFrontItemIdx() == -1) back->setFrontItemIdx(0);
+      back->setBackItemIdx(backItemIdx + n);
+      data += n;
+      remaining -= n;
+    }
+  }
+  ByteQueueFragment::pool.deallocateBatch(supply);
+  return done;
+}
+
+// Fills spans with the queue's bytes in order, one span per fragment
+size_t readable_spans(ByteQueueFragment* front, 
+                      ByteSpan* spans, size_t maxSpans) {
+  if(front == nullptr || front->isEmpty()) return 0;
+  size_t numSpans = 0;
+  ByteQueueFragment* back = front->getBackFragment();
+  ByteQueueFragment* fragment = front;
+  while(numSpans < maxSpans) {
+    spans[numSpans++] = fragment->getSpan(fragment->getFrontItemIdx(), 
+                                          fragment->getBackItemIdx());
+    if(fragment == back) break;
+    fragment = fragment->getNextFragment();
+  }
+  return numSpans;
+}
+
+
+/* * * * * * * * * * Iterators * * * * * * * * * */
+
+// Forward iterator over the bytes of a queue, front to back.
+// Stepping within a fragment is just an index increment, the next
+// fragment is only looked up when crossing the fragment's back byte.
+class ByteQueueIterator {
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef unsigned char value_type;
+    typedef ptrdiff_t difference_type;
+    typedef unsigned char* pointer;
+    typedef unsigned char& reference;
+
+    ByteQueueIterator() : fragment(nullptr), back(nullptr), idx(0) {}
+    explicit ByteQueueIterator(ByteQueueFragment* front) 
+      : ByteQueueIterator() {
+      if(front == nullptr || front->isEmpty()) return;
+      fragment = front;
+      back = front->getBackFragment();
+      idx = front->getFrontItemIdx();
+    }
+    reference operator*() const { 
+      return fragment->chunk.whenUsed.bytes[size_t(idx)]; 
+    }
+    ByteQueueIterator& operator++() {
+      if(idx < fragment->getBackItemIdx()) {
+        ++idx;
+      }
+      else if(fragment == back) {
+        // Past the back byte, equal to end()
+        fragment = nullptr;
+        idx = 0;
+      }
+      else {
+        fragment = fragment->getNextFragment();
+        idx = fragment->getFrontItemIdx();
+      }
+      return *this;
+    }
+    ByteQueueIterator operator++(int) {
+      ByteQueueIterator previous = *this;
+      ++*this;
+      return previous;
+    }
+    bool operator==(const ByteQueueIterator& other) const {
+      return fragment == other.fragment && idx == other.idx;
+    }
+    bool operator!=(const ByteQueueIterator& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    ByteQueueFragment* fragment;
+    ByteQueueFragment* back;
+    char idx;
+};
+
+// Iterator over the contiguous spans of a queue, one per fragment, 
+// so algorithms can run a tight loop over each span.
+class ByteQueueSpanIterator {
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ByteSpan value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const ByteSpan* pointer;
+    typedef const ByteSpan& reference;
+
+    ByteQueueSpanIterator() : fragment(nullptr), back(nullptr), span{} {}
+    explicit ByteQueueSpanIterator(ByteQueueFragment* front) 
+      : ByteQueueSpanIterator() {
+      if(front == nullptr || front->isEmpty()) return;
+      back = front->getBackFragment();
+      setFragment(front);
+    }
+    reference operator*() const { return span; }
+    pointer operator->() const { return &span; }
+    ByteQueueSpanIterator& operator++() {
+      if(fragment == back) {
+        fragment = nullptr;
+        span = ByteSpan{};
+      }
+      else {
+        setFragment(fragment->getNextFragment());
+      }
+      return *this;
+    }
+    ByteQueueSpanIterator operator++(int) {
+      ByteQueueSpanIterator previous = *this;
+      ++*this;
+      return previous;
+    }
+    bool operator==(const ByteQueueSpanIterator& other) const {
+      return fragment == other.fragment;
+    }
+    bool operator!=(const ByteQueueSpanIterator& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    void setFragment(ByteQueueFragment* newFragment) {
+      fragment = newFragment;
+      span = fragment->getSpan(fragment->getFrontItemIdx(), 
+                               fragment->getBackItemIdx());
+    }
+    ByteQueueFragment* fragment;
+    ByteQueueFragment* back;
+    ByteSpan span;
+};
+
+// Range of a queue's spans, for range-based for loops
+class ByteQueueSpans {
+
+  public:
+    explicit ByteQueueSpans(ByteQueueFragment* front) : front(front) {}
+    ByteQueueSpanIterator begin() const { 
+      return ByteQueueSpanIterator(front); 
+    }
+    ByteQueueSpanIterator end() const { return ByteQueueSpanIterator(); }
+
+  private:
+    ByteQueueFragment* front;
+};
+
+
+/* * * * * * * * * * Messages * * * * * * * * * */
+/*
+A message is framed as its length followed by its bytes. The length is
+a varint: 7 bits per byte, least significant first, with the top bit set
+on every byte but the last. Messages under 128 bytes take one extra byte.
+*/
+//
+// Decodes the length prefix of the message at the front of the queue.
+// Returns the message length and sets prefixLen to the prefix's size.
+// Returns npos if the prefix is incomplete, or malformed_message if it
+// can't be a length, which no more bytes will fix.
+size_t peek_message_prefix(ByteQueueFragment* front, size_t& prefixLen) {
+  size_t len = 0;
+  prefixLen = 0;
+  ByteQueueIterator end;
+  for(ByteQueueIterator it(front); it != end; ++it) {
+    // A size_t takes at most 10 varint bytes, the last holding one bit
+    if(prefixLen == 10 || (prefixLen == 9 && (*it & 0x7e) != 0)) {
+      return malformed_message;
+    }
+    len |= size_t(*it & 0x7f) << (7 * prefixLen);
+    ++prefixLen;
+    if((*it & 0x80) == 0) return len;
+  }
+  return npos;
+}
+
+// Returns the length of the message at the front of the queue,
+// npos if no complete message is queued yet, or malformed_message
+size_t peek_message_length(ByteQueueFragment* front) {
+  size_t prefixLen;
+  size_t len = peek_message_prefix(front, prefixLen);
+  if(len == npos || len == malformed_message) return len;
+  if(queue_size(front) - prefixLen < len) return npos;
+  return len;
+}
+
+// Enqueues data as one message. Either the whole message is enqueued or,
+// if the pool doesn't have room for it, nothing is.
+QueueError push_message(ByteQueueFragment*& front, 
+                        const unsigned char* data, size_t len) {
+  unsigned char prefix[10];
+  size_t prefixLen = 0;
+  size_t remaining = len;
+  do {
+    prefix[prefixLen] = remaining & 0x7f;
+    remaining >>= 7;
+    if(remaining != 0) prefix[prefixLen] |= 0x80;
+    ++prefixLen;
+  } while(remaining != 0);
+  // Prefix and message are reserved together, so neither is enqueued
+  // without the other
+  ByteSpan spans[kMaxReservedSpans];
+  if(enqueue_capacity(front) < prefixLen + len ||
+     reserve_bytes(front, spans, prefixLen + len) == 0) {
+    on_out_of_memory();
+    return QueueError::OutOfMemory;
+  }
+  copy_to_spans(spans, 0, prefix, prefixLen);
+  copy_to_spans(spans, prefixLen, data, len);
+  commit(front, prefixLen + len);
+  return QueueError::None;
+}
+
+// Dequeues the message at the front of the queue into out.
+// Returns its length, or npos if no complete message is queued. In that
+// case the queue is left as it was, as it is when returning:
+//   - message_too_long if the message is longer than capacity, as soon
+//     as its prefix is queued. peek_message_prefix() gives its length.
+//   - malformed_message if the length prefix is malformed: the stream
+//     can't be framed past it.
+size_t pop_message(ByteQueueFragment*& front, 
+                   unsigned char* out, size_t capacity) {
+  size_t prefixLen;
+  size_t len = peek_message_prefix(front, prefixLen);
+  if(len == npos || len == malformed_message) return len;
+  if(len > capacity) return message_too_long;
+  if(copy_out(front, prefixLen, len, out) < len) return npos;
+  skip(front, prefixLen + len);
+  return len;
+}
+
+
+/* * * * * * * * * * Integers * * * * * * * * * */
+/*
+Fixed-width integers are enqueued as 2, 4 or 8 bytes, little-endian by
+default. When the value fits in the back fragment (or is all in the front
+fragment when dequeuing) it is moved with a single unaligned store or 
+load. Otherwise it is split across fragments via the bulk operations.
+*/
+//
+// Reverses the byte order of value when the host's order differs
+template <typename T>
+T convert_byte_order(T value, bool isBigEndian) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  bool isSwapped = isBigEndian;
+#else
+  bool isSwapped = !isBigEndian;
+#endif
+  if(!isSwapped) return value;
+  if constexpr(sizeof(T) == 2) return __builtin_bswap16(value);
+  if constexpr(sizeof(T) == 4) return __builtin_bswap32(value);
+  if constexpr(sizeof(T) == 8) return __builtin_bswap64(value);
+  return value;
+}
+
+template <typename T>
+QueueError enqueue_uint(ByteQueueFragment*& front, T value, bool isBigEndian) {
+  value = convert_byte_order(value, isBigEndian);
+  if(front != nullptr) {
+    ByteQueueFragment* back = front->getBackFragment();
+    char backItemIdx = back->getBackItemIdx();
+    // Fast path, the value fits in the back fragment
+    if(27 - backItemIdx >= char(sizeof(T))) {
+      memcpy(&back->chunk.whenUsed.bytes[backItemIdx + 1], &value, sizeof(T));
+      if(back->getFrontItemIdx() == -1) back->setFrontItemIdx(0);
+      back->setBackItemIdx(backItemIdx + sizeof(T));
+      return QueueError::None;
+    }
+  }
+  unsigned char bytes[sizeof(T)];
+  memcpy(bytes, &value, sizeof(T));
+  return enqueue_bytes(front, bytes, sizeof(T));
+}
+
+// Returns false, leaving the queue as it was, if it has too few bytes
+template <typename T>
+bool try_dequeue_uint(ByteQueueFragment*& front, T& value, bool isBigEndian) {
+  if(front == nullptr || front->isEmpty()) return false;
+  char frontItemIdx = front->getFrontItemIdx();
+  size_t count = front->getBackItemIdx() - frontItemIdx + 1;
+  // Fast path, the value is all in the front fragment
+  if(count >= sizeof(T)) {
+    memcpy(&value, &front->chunk.whenUsed.bytes[size_t(frontItemIdx)],
+           sizeof(T));
+    if(count == sizeof(T)) {
+      front = front->popFront();
+    }
+    else {
+      front->setFrontItemIdx(frontItemIdx + sizeof(T));
+    }
+  }
+  else {
+    unsigned char bytes[sizeof(T)];
+    if(copy_out(front, 0, sizeof(T), bytes) < sizeof(T)) return false;
+    skip(front, sizeof(T));
+    memcpy(&value, bytes, sizeof(T));
+  }
+  value = convert_byte_order(value, isBigEndian);
+  return true;
+}
+
+// Reports an illegal operation and returns 0 if the queue has too few bytes
+template <typename T>
+T dequeue_uint(ByteQueueFragment*& front, bool isBigEndian) {
+  T value;
+  if(!try_dequeue_uint(front, value, isBigEndian)) {
+    on_illegal_operation();
+    return 0;
+  }
+  return value;
+}
+
+QueueError enqueue_u16(ByteQueueFragment*& front, uint16_t value) {
+  return enqueue_uint(front, value, false);
+}
+QueueError enqueue_u32(ByteQueueFragment*& front, uint32_t value) {
+  return enqueue_uint(front, value, false);
+}
+QueueError enqueue_u64(ByteQueueFragment*& front, uint64_t value) {
+  return enqueue_uint(front, value, false);
+}
+QueueError enqueue_u16_be(ByteQueueFragment*& front, uint16_t value) {
+  return enqueue_uint(front, value, true);
+}
+QueueError enqueue_u32_be(ByteQueueFragment*& front, uint32_t value) {
+  return enqueue_uint(front, value, true);
+}
+QueueError enqueue_u64_be(ByteQueueFragment*& front, uint64_t value) {
+  return enqueue_uint(front, value, true);
+}
+
+uint16_t dequeue_u16(ByteQueueFragment*& front) {
+  return dequeue_uint<uint16_t>(front, false);
+}
+uint32_t dequeue_u32(ByteQueueFragment*& front) {
+  return dequeue_uint<uint32_t>(front, false);
+}
+uint64_t dequeue_u64(ByteQueueFragment*& front) {
+  return dequeue_uint<uint64_t>(front, false);
+}
+uint16_t dequeue_u16_be(ByteQueueFragment*& front) {
+  return dequeue_uint<uint16_t>(front, true);
+}
+uint32_t dequeue_u32_be(ByteQueueFragment*& front) {
+  return dequeue_uint<uint32_t>(front, true);
+}
+uint64_t dequeue_u64_be(ByteQueueFragment*& front) {
+  return dequeue_uint<uint64_t>(front, true);
+}
+
+
+/* * * * * * * * * * Checksums * * * * * * * * * */
+/*
+Checksums run directly over the fragment spans of a byte range, so a
+message can be verified without copying it out first.
+
+    checksum   CRC32C, with the SSE4.2 crc32 instruction when the CPU has
+               it (picked once at startup), a lookup table otherwise
+    hash64     XXH64, a fast 64-bit non-cryptographic hash
+
+Both take the result so far as a starting value, so a running checksum
+can be kept up as bytes are enqueued: checksum the new bytes only,
+starting from the previous result.
+*/
+//
+// Calls visit(data, len) for each span in the len bytes at offset
+template <typename Visit>
+void for_each_span(ByteQueueFragment* front, size_t offset, size_t len, 
+                   Visit visit) {
+  for(ByteSpan span : ByteQueueSpans(front)) {
+    if(len == 0) return;
+    if(offset >= span.len) {
+      offset -= span.len;
+      continue;
+    }
+    size_t count = span.len - offset < len ? span.len - offset : len;
+    visit(span.data + offset, count);
+    len -= count;
+    offset = 0;
+  }
+}
+
+/* CRC32C */
+
+struct Crc32cTable {
+  uint32_t entries[256];
+  Crc32cTable() {
+    for(uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for(int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+const Crc32cTable crc32c_table;
+
+// The raw functions work on the inverted crc
+uint32_t crc32c_raw_table(uint32_t crc, const unsigned char* data, 
+                          size_t len) {
+  for(size_t i = 0; i < len; ++i) {
+    crc = crc32c_table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef __SSE2__
+__attribute__((target("sse4.2")))
+uint32_t crc32c_raw_sse42(uint32_t crc, const unsigned char* data, 
+                          size_t len) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for(; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+#endif
+  for(; len >= 4; data += 4, len -= 4) {
+    uint32_t word;
+    memcpy(&word, data, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  for(; len > 0; ++data, --len) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cRawFn)(uint32_t, const unsigned char*, size_t);
+
+Crc32cRawFn select_crc32c_raw() {
+#ifdef __SSE2__
+  if(__builtin_cpu_supports("sse4.2")) return crc32c_raw_sse42;
+#endif
+  return crc32c_raw_table;
+}
+
+const Crc32cRawFn crc32c_raw = select_crc32c_raw();
+
+// Returns the CRC32C of the bytes that gave crc followed by data.
+// Start from crc = 0.
+uint32_t crc32c_update(uint32_t crc, const unsigned char* data, size_t len) {
+  return ~crc32c_raw(~crc, data, len);
+}
+
+// Returns the CRC32C of the len bytes at offset from the front of the 
+// queue, continuing from crc
+uint32_t checksum(ByteQueueFragment* front, size_t offset, size_t len,
+                  uint32_t crc = 0) {
+  crc = ~crc;
+  for_each_span(front, offset, len, 
+    [&crc](const unsigned char* data, size_t count) {
+      crc = crc32c_raw(crc, data, count);
+    });
+  return ~crc;
+}
+
+/* XXH64 */
+
+// Streaming XXH64 state, bytes are buffered until a 32-byte stripe is full
+class Xxh64 {
+
+  public:
+    explicit Xxh64(uint64_t seed = 0) 
+      : acc{seed + prime1 + prime2, seed + prime2, seed, seed - prime1},
+        seed(seed), totalLen(0), bufferLen(0) {}
+    void update(const unsigned char* data, size_t len) {
+      totalLen += len;
+      // Top up a partial stripe first
+      if(bufferLen > 0) {
+        size_t count = 32 - bufferLen < len ? 32 - bufferLen : len;
+        memcpy(buffer + bufferLen, data, count);
+        bufferLen += count;
+        data += count;
+        len -= count;
+        if(bufferLen < 32) return;
+        consumeStripe(buffer);
+        bufferLen = 0;
+      }
+      for(; len >= 32; data += 32, len -= 32) {
+        consumeStripe(data);
+      }
+      memcpy(buffer, data, len);
+      bufferLen = len;
+    }
+    uint64_t digest() const {
+      uint64_t hash;
+      if(totalLen >= 32) {
+        hash = rotl(acc[0], 1) + rotl(acc[1], 7) + 
+               rotl(acc[2], 12) + rotl(acc[3], 18);
+        for(int i = 0; i < 4; ++i) {
+          hash = (hash ^ round(0, acc[i])) * prime1 + prime4;
+        }
+      }
+      else {
+        hash = seed + prime5;
+      }
+      hash += totalLen;
+      const unsigned char* data = buffer;
+      size_t len = bufferLen;
+      for(; len >= 8; data += 8, len -= 8) {
+        hash ^= round(0, read64(data));
+        hash = rotl(hash, 27) * prime1 + prime4;
+      }
+      if(len >= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        hash ^= word * prime1;
+        hash = rotl(hash, 23) * prime2 + prime3;
+        data += 4;
+        len -= 4;
+      }
+      for(; len > 0; ++data, --len) {
+        hash ^= *data * prime5;
+        hash = rotl(hash, 11) * prime1;
+      }
+      hash ^= hash >> 33;
+      hash *= prime2;
+      hash ^= hash >> 29;
+      hash *= prime3;
+      hash ^= hash >> 32;
+      return hash;
+    }
+
+  private:
+    static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+    static const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+    static uint64_t rotl(uint64_t value, int bits) {
+      return (value << bits) | (value >> (64 - bits));
+    }
+    static uint64_t round(uint64_t acc, uint64_t input) {
+      return rotl(acc + input * prime2, 31) * prime1;
+    }
+    static uint64_t read64(const unsigned char* data) {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      return word;
+    }
+    void consumeStripe(const unsigned char* stripe) {
+      for(int i = 0; i < 4; ++i) {
+        acc[i] = round(acc[i], read64(stripe + 8 * i));
+      }
+    }
+    uint64_t acc[4];
+    uint64_t seed;
+    uint64_t totalLen;
+    unsigned char buffer[32];
+    size_t bufferLen;
+};
+
+// Returns the XXH64 of the len bytes at offset from the front of the queue
+uint64_t hash64(ByteQueueFragment* front, size_t offset, size_t len,
+                uint64_t seed = 0) {
+  Xxh64 state(seed);
+  for_each_span(front, offset, len, 
+    [&state](const unsigned char* data, size_t count) {
+      state.update(data, count);
+    });
+  return state.digest();
+}
+
+
+/* * * * * * * * * * Coroutines * * * * * * * * * */
+/*
+Protocol handlers can be written as coroutines that wait for bytes in a
+queue, or for room in the pool, instead of as callbacks:
+
+    Task handle(ByteQueue& in, ByteQueue& out) {
+      while(true) {
+        std::vector<unsigned char> header = co_await in.read(2);
+        ...
+        co_await out.write(ByteSpan{reply, len});
+      }
+    }
+
+    Executor executor;
+    executor.spawn(handle(in, out));
+    executor.run();
+
+Everything runs on the thread calling run(). An awaitable that can't
+complete yet leaves its coroutine with the executor, which polls it
+again after resuming the coroutines that are ready. A Task can only
+await these awaitables, not another Task.
+*/
+//
+class Executor;
+
+class Task {
+
+  public:
+    struct promise_type {
+      Executor* executor = nullptr;
+      Task get_return_object() {
+        return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      // Tasks start when spawned, and the executor frees them when done
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+    Task(Task&& other) noexcept : handle(other.handle) {
+      other.handle = nullptr;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if(handle) handle.destroy(); }
+
+  private:
+    explicit Task(std::coroutine_handle<promise_type> coroutine)
+      : handle(coroutine) {}
+    std::coroutine_handle<promise_type> handle;
+  friend class Executor;
+};
+
+// Checks if an awaitable can complete, making what progress it can
+typedef bool (*PollFn)(void* awaitable);
+
+class Executor {
+
+  public:
+    Executor() {}
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    void spawn(Task task);
+    // Resumes tasks until all are done or all are waiting, and returns
+    // the number waiting. Call again once more bytes can have arrived.
+    size_t run();
+    // For awaitables: resume handle once poll(awaitable) returns true
+    void wait(std::coroutine_handle<> handle, PollFn poll, void* awaitable);
+
+  private:
+    struct Waiter {
+      std::coroutine_handle<> handle;
+      PollFn poll;
+      void* awaitable;
+    };
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<Waiter> waiting;
+};
+
+Executor::~Executor() {
+  for(std::coroutine_handle<> handle : ready) handle.destroy();
+  for(Waiter& waiter : waiting) waiter.handle.destroy();
+}
+
+void Executor::spawn(Task task) {
+  task.handle.promise().executor = this;
+  ready.push_back(task.handle);
+  task.handle = nullptr;
+}
+
+size_t Executor::run() {
+  std::vector<std::coroutine_handle<>> resuming;
+  while(true) {
+    for(size_t i = 0; i < waiting.size();) {
+      if(!waiting[i].poll(waiting[i].awaitable)) {
+        ++i;
+        continue;
+      }
+      ready.push_back(waiting[i].handle);
+      waiting[i] = waiting.back();
+      waiting.pop_back();
+    }
+    if(ready.empty()) return waiting.size();
+    resuming.swap(ready);
+    for(std::coroutine_handle<> handle : resuming) {
+      handle.resume();
+      if(handle.done()) handle.destroy();
+    }
+    resuming.clear();
+  }
+}
+
+void Executor::wait(std::coroutine_handle<> handle, PollFn poll,
+                    void* awaitable) {
+  waiting.push_back(Waiter{handle, poll, awaitable});
+}
+
+// co_await gives the next n bytes of the queue, waiting until there are n
+class QueueReadAwaitable {
+
+  public:
+    QueueReadAwaitable(ByteQueueFragment*& front, size_t n)
+      : front(front), n(n) {}
+    bool await_ready() { return poll(this); }
+    template <typename Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle) {
+      handle.promise().executor->wait(handle, poll, this);
+    }
+    std::vector<unsigned char> await_resume() { return std::move(bytes); }
+
+  private:
+    // Takes all n bytes at once, so readers of one queue don't interleave
+    static bool poll(void* awaitable) {
+      QueueReadAwaitable* read = static_cast<QueueReadAwaitable*>(awaitable);
+      if(queue_size(read->front) < read->n) return false;
+      read->bytes.resize(read->n);
+      copy_out(read->front, 0, read->n, read->bytes.data());
+      skip(read->front, read->n);
+      return true;
+    }
+    ByteQueueFragment*& front;
+    size_t n;
+    std::vector<unsigned char> bytes;
+};
+
+// co_await enqueues the span's bytes, waiting for room in the pool.
+// Bytes are enqueued as room frees up, so spans larger than the pool work.
+class QueueWriteAwaitable {
+
+  public:
+    QueueWriteAwaitable(ByteQueueFragment*& front, ByteSpan span)
+      : front(front), span(span) {}
+    bool await_ready() { return poll(this); }
+    template <typename Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle) {
+      handle.promise().executor->wait(handle, poll, this);
+    }
+    void await_resume() {}
+
+  private:
+    static bool poll(void* awaitable) {
+      QueueWriteAwaitable* write = 
+        static_cast<QueueWriteAwaitable*>(awaitable);
+      size_t count = enqueue_capacity(write->front);
+      if(count > write->span.len) count = write->span.len;
+      // Other threads may take the room first, then try again next poll
+      if(count > 0 && try_enqueue_bytes(write->front, write->span.data, 
+                                        count) == QueueError::None) {
+        write->span.data += count;
+        write->span.len -= count;
+      }
+      return write->span.len == 0;
+    }
+    ByteQueueFragment*& front;
+    ByteSpan span;
+};
+
+/* * * * * * * * * * ByteQueue * * * * * * * * * */
+/* * * * * * * * (RAII Handle) * * * * * * * * */
+
+// Owns a queue and destroys it when it goes out of scope. 
+// Move-only: moving transfers the front fragment, copying is not allowed.
+// Member operations are thin inline wrappers over the friend functions.
+class ByteQueue {
+
+  public:
+    ByteQueue() : front(nullptr) {}
+    ~ByteQueue() { ::destroy_queue(front); }
+    ByteQueue(const ByteQueue&) = delete;
+    ByteQueue& operator=(const ByteQueue&) = delete;
+    ByteQueue(ByteQueue&& other) noexcept : front(other.front) {
+      other.front = nullptr;
+    }
+    ByteQueue& operator=(ByteQueue&& other) noexcept {
+      if(this != &other) {
+        ::destroy_queue(front);
+        front = other.front;
+        other.front = nullptr;
+      }
+      return *this;
+    }
+    // Operations
+    QueueError enqueue(unsigned char byte) { 
+      return ::enqueue_byte(front, byte); 
+    }
+    unsigned char dequeue() { return ::dequeue_byte(front); }
+    bool tryDequeue(unsigned char& byte) { 
+      return ::try_dequeue_byte(front, byte); 
+    }
+    QueueError enqueueBytes(const unsigned char* data, size_t len) {
+      return ::enqueue_bytes(front, data, len);
+    }
+    size_t skip(size_t n) { return ::skip(front, n); }
+    size_t size() { return ::queue_size(front); }
+    void clear() { ::destroy_queue(front); }
+    bool isEmpty() { return ::queue_empty(front); }
+    // Splice and split
+    void append(ByteQueue& other) { ::splice(front, other.front); }
+    ByteQueue split(size_t n) { return ByteQueue(::split(front, n)); }
+    QueueError transferTo(ByteQueue& other, size_t n) {
+      return ::transfer(front, other.front, n);
+    }
+    // Reading without consuming
+    unsigned char at(size_t offset) { return ::at(front, offset); }
+    size_t copyOut(size_t offset, size_t len, unsigned char* dst) {
+      return ::copy_out(front, offset, len, dst);
+    }
+    size_t findByte(unsigned char value, size_t start = 0) {
+      return ::find_byte(front, value, start);
+    }
+    size_t find(const unsigned char* needle, size_t len, size_t start = 0) {
+      return ::find(front, needle, len, start);
+    }
+    // Messages
+    QueueError pushMessage(const unsigned char* data, size_t len) {
+      return ::push_message(front, data, len);
+    }
+    size_t popMessage(unsigned char* out, size_t capacity) {
+      return ::pop_message(front, out, capacity);
+    }
+    size_t peekMessageLength() { return ::peek_message_length(front); }
+    // Integers
+    template <typename T>
+    QueueError enqueueUint(T value, bool isBigEndian = false) {
+      return ::enqueue_uint(front, value, isBigEndian);
+    }
+    template <typename T>
+    T dequeueUint(bool isBigEndian = false) {
+      return ::dequeue_uint<T>(front, isBigEndian);
+    }
+    // Checksums
+    uint32_t checksum(size_t offset, size_t len, uint32_t crc = 0) {
+      return ::checksum(front, offset, len, crc);
+    }
+    uint64_t hash64(size_t offset, size_t len, uint64_t seed = 0) {
+      return ::hash64(front, offset, len, seed);
+    }
+    // Spans
+    size_t reserveSpans(ByteSpan* spans, size_t maxSpans) {
+      return ::reserve_spans(front, spans, maxSpans);
+    }
+    void commit(size_t n) { ::commit(front, n); }
+    size_t readableSpans(ByteSpan* spans, size_t maxSpans) {
+      return ::readable_spans(front, spans, maxSpans);
+    }
+    // Coroutines. The queue never holds more than the pool
+    // (FragmentPool::kByteCapacity), so a longer read could never complete:
+    // it reports QueueError::ReadTooLong and gives no bytes
+    QueueReadAwaitable read(size_t n) {
+      if(n > FragmentPool::kByteCapacity) {
+        on_read_too_long();
+        n = 0;
+      }
+      return QueueReadAwaitable(front, n);
+    }
+    QueueWriteAwaitable write(ByteSpan span) {
+      return QueueWriteAwaitable(front, span);
+    }
+    // Iterators
+    ByteQueueIterator begin() { return ByteQueueIterator(front); }
+    ByteQueueIterator end() { return ByteQueueIterator(); }
+    ByteQueueSpans spans() { return ByteQueueSpans(front); }
+    // For use with the friend functions and I/O engines
+    ByteQueueFragment*& handle() { return front; }
+    // Gives up ownership of the queue without destroying it
+    ByteQueueFragment* release() {
+      ByteQueueFragment* released = front;
+      front = nullptr;
+      return released;
+    }
+
+  private:
+    explicit ByteQueue(ByteQueueFragment* queue) : front(queue) {}
+    ByteQueueFragment* front;
+};
+
+/* * * * * * * * * * Scheduling * * * * * * * * * */
+/*
+DrrScheduler drains many queues fairly onto one output with deficit round
+robin. Each attached queue gets a quantum: on its turn it may send up to
+that many bytes. Queues with data are kept in a ring, linked through
+their slots, so empty queues are never visited.
+
+              ┌──────┐   ┌──────┐   ┌──────┐
+          ┌──>│slot 3│──>│slot 9│──>│slot 4│──┐
+          │   └──────┘   └──────┘   └──────┘  │
+          └───────────────────────────────────┘
+                  ↑
+               current
+
+A queue joins the ring when activate() is called after bytes are enqueued
+onto it (enqueue() does this), and leaves it when it is drained empty.
+*/
+//
+class DrrScheduler {
+
+  public:
+    DrrScheduler();
+    // Returns the slot of the attached queue, or -1 if all 64 are taken
+    int attach(ByteQueueFragment*& front, size_t quantum);
+    void detach(int slot);
+    void activate(int slot);
+    QueueError enqueue(int slot, const unsigned char* data, size_t len);
+    // Fills out with up to capacity bytes, taking turns between the 
+    // queues with data. Returns the number of bytes written.
+    size_t drain(unsigned char* out, size_t capacity);
+
+  private:
+    struct Slot {
+      ByteQueueFragment** queue;
+      size_t quantum;
+      size_t deficit;
+      int next;
+      int prev;
+      bool isActive;
+    };
+    void unlink(int slot);
+    Slot slots[64];
+    int current;
+};
+
+DrrScheduler::DrrScheduler() : current(-1) {
+  for(Slot& slot : slots) {
+    slot = Slot{nullptr, 0, 0, -1, -1, false};
+  }
+}
+
+int DrrScheduler::attach(ByteQueueFragment*& front, size_t quantum) {
+  for(int i = 0; i < 64; ++i) {
+    if(slots[i].queue != nullptr) continue;
+    slots[i] = Slot{&front, quantum > 0 ? quantum : 1, 0, -1, -1, false};
+    activate(i);
+    return i;
+  }
+  return -1;
+}
+
+void DrrScheduler::detach(int slot) {
+  if(slots[slot].isActive) unlink(slot);
+  slots[slot].queue = nullptr;
+}
+
+// Adds the slot to the ring, just behind current, if its queue has data
+void DrrScheduler::activate(int slot) {
+  Slot& added = slots[slot];
+  if(added.isActive || queue_empty(*added.queue)) return;
+  added.isActive = true;
+  added.deficit = 0;
+  if(current == -1) {
+    added.next = added.prev = slot;
+    current = slot;
+    return;
+  }
+  Slot& next = slots[current];
+  added.next = current;
+  added.prev = next.prev;
+  slots[next.prev].next = slot;
+  next.prev = slot;
+}
+
+void DrrScheduler::unlink(int slot) {
+  Slot& removed = slots[slot];
+  removed.isActive = false;
+  removed.deficit = 0;
+  if(removed.next == slot) {
+    current = -1;
+    return;
+  }
+  slots[removed.prev].next = removed.next;
+  slots[removed.next].prev = removed.prev;
+  if(current == slot) current = removed.next;
+}
+
+QueueError DrrScheduler::enqueue(int slot, const unsigned char* data, 
+                                 size_t len) {
+  QueueError error = enqueue_bytes(*slots[slot].queue, data, len);
+  activate(slot);
+  return error;
+}
+
+size_t DrrScheduler::drain(unsigned char* out, size_t capacity) {
+  size_t written = 0;
+  while(written < capacity && current != -1) {
+    Slot& slot = slots[current];
+    // Start of the slot's turn
+    if(slot.deficit == 0) slot.deficit = slot.quantum;
+    size_t n = slot.deficit < capacity - written 
+      ? slot.deficit : capacity - written;
+    n = copy_out(*slot.queue, 0, n, out + written);
+    skip(*slot.queue, n);
+    written += n;
+    slot.deficit -= n;
+    if(queue_empty(*slot.queue)) {
+      unlink(current);
+    }
+    else if(slot.deficit == 0) {
+      current = slot.next;
+    }
+  }
+  return written;
+}
+
+
+/*************************/
+/* C O N C U R R E N C Y */ 
+/*************************/
+/*
+The operations above are not thread safe: enqueue and dequeue both update
+the same fragments. The queues here are shared between threads instead.
+They take fragments from the same pool, whose free list is lock-free, so
+threads allocating and freeing never wait on each other.
+
+For these queues an empty pool is backpressure, not an error: enqueues
+return QueueError::OutOfMemory without reporting it, and can be retried
+once the consumer frees fragments.
+*/
+
+/* * * * * * * * * * Parker * * * * * * * * * */
+/*
+A Parker lets a consumer thread sleep while its queue is empty, instead of
+spinning on it. The consumer marks itself parked, checks the queue once
+more, and sleeps on a futex until a producer wakes it or the timeout
+passes. Producers only wake it when it is parked, so enqueues onto a
+queue with bytes to read cost a fence and a load, not a system call.
+
+Instead of sleeping, a consumer driven by an event loop can arm the
+Parker, so the next producer to publish signals an eventfd. Its epoll
+loop then learns which queues became readable without polling them.
+
+A Parker in memory shared between processes waits on a shared futex,
+so a producer in another process can wake it. Eventfds only signal within
+the process that set them, and their numbers mean nothing in another, so
+a process-shared Parker ignores them.
+
+Without futexes (not Linux) the consumer yields instead of sleeping.
+*/
+//
+class Parker {
+
+  public:
+    explicit Parker(bool isProcessShared = false)
+      : parked(kAwake), eventFd(-1), isProcessShared(isProcessShared) {}
+    // Consumer: sleeps until isReady() or deadline, returns false
+    // if the deadline passed
+    template <typename Ready>
+    bool park(Ready isReady, std::chrono::steady_clock::time_point deadline);
+    // Consumer: has the next unpark() signal the eventfd, returns false
+    // without arming if isReady() already
+    template <typename Ready>
+    bool arm(Ready isReady);
+    // Ignored if process-shared
+    void setEventFd(int fd);
+    // Producer: wakes the consumer if it is parked or armed
+    void unpark();
+
+  private:
+    enum : uint32_t { kAwake, kSleeping, kArmed };
+    std::atomic<uint32_t> parked;
+    int eventFd;
+    bool isProcessShared;
+};
+
+template <typename Ready>
+bool Parker::park(Ready isReady,
+                  std::chrono::steady_clock::time_point deadline) {
+  // The fences pair with unpark(): either the producer sees parked,
+  // or this thread sees the bytes the producer published
+  parked.store(kSleeping, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(isReady()) {
+    parked.store(kAwake, std::memory_order_relaxed);
+    return true;
+  }
+  std::chrono::steady_clock::duration remaining =
+    deadline - std::chrono::steady_clock::now();
+  if(remaining <= std::chrono::steady_clock::duration::zero()) {
+    parked.store(kAwake, std::memory_order_relaxed);
+    return false;
+  }
+#ifdef __linux__
+  std::chrono::seconds seconds =
+    std::chrono::duration_cast<std::chrono::seconds>(remaining);
+  struct timespec timeout;
+  timeout.tv_sec = seconds.count();
+  timeout.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    remaining - seconds).count();
+  // Returns at once if a producer already cleared parked
+  syscall(SYS_futex, &parked,
+          isProcessShared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, kSleeping,
+          &timeout, nullptr, 0);
+#else
+  std::this_thread::yield();
+#endif
+  parked.store(kAwake, std::memory_order_relaxed);
+  return true;
+}
+
+template <typename Ready>
+bool Parker::arm(Ready isReady) {
+  // As in park()
+  parked.store(kArmed, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(isReady()) {
+    parked.store(kAwake, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void Parker::setEventFd(int fd) {
+  if(isProcessShared) return;
+  eventFd = fd;
+}
+
+void Parker::unpark() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(parked.load(std::memory_order_relaxed) == kAwake) return;
+  uint32_t state = parked.exchange(kAwake, std::memory_order_relaxed);
+#ifdef __linux__
+  if(state == kSleeping) {
+    syscall(SYS_futex, &parked,
+            isProcessShared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1,
+            nullptr, nullptr, 0);
+  }
+  if(state == kArmed && eventFd != -1) eventfd_write(eventFd, 1);
+#endif
+}
+
+/* * * * * * * * * * Epoch Reclamation * * * * * * * * * */
+/*
+An EpochReclaimer lets threads read fragments of a queue while its
+consumer frees them. The consumer retires fragments instead of
+deallocating them, and they are only deallocated once no reader can
+still be looking at them.
+
+  - A global epoch counts up. A reader pins itself to the current epoch
+    before reading fragments and unpins when done.
+  - A fragment retired in epoch e waits in a list for that epoch.
+  - The retiring thread advances the epoch once every pinned reader is
+    pinned to the current one, and then deallocates the fragments
+    retired two epochs before, since every reader pinned then is gone.
+
+Readers never wait, and only write their own slot. A reader pinned for
+long holds the epoch back, keeping retired fragments out of the pool.
+Fragments are retired by one thread, and the pool's 64 fragments bound
+each epoch's list.
+*/
+//
+class EpochReclaimer {
+
+  public:
+    EpochReclaimer();
+    explicit EpochReclaimer(FragmentPool& pool);
+    // Deallocates every retired fragment, once no reader is pinned
+    ~EpochReclaimer();
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+    // Readers
+    // Returns the slot a reader pins with, or -1 if all are taken
+    int addReader();
+    // Fragments the reader finds after pin() aren't deallocated
+    // before unpin()
+    void pin(int reader);
+    void unpin(int reader);
+    // Retiring thread
+    // Deallocates fragment once no reader can be reading it
+    void retire(ByteQueueFragment* fragment);
+    // Deallocates the retired fragments no reader can be reading
+    void reclaim();
+    // The pool retired fragments are deallocated to
+    FragmentPool& getPool();
+
+  private:
+    static const int kMaxReaders = 16;
+    // 0 when unpinned, else the epoch pinned to, shifted, plus 1
+    struct alignas(64) Reader {
+      std::atomic<uint64_t> pinned;
+    };
+    bool tryAdvance();
+    void deallocateRetired(int list);
+    FragmentPool* pool;
+    Reader readers[kMaxReaders];
+    std::atomic<int> numReaders;
+    alignas(64) std::atomic<uint64_t> epoch;
+    char retired[3][64];
+    size_t numRetired[3];
+};
+
+EpochReclaimer::EpochReclaimer()
+  : EpochReclaimer(ByteQueueFragment::pool) {}
+
+EpochReclaimer::EpochReclaimer(FragmentPool& pool)
+  : pool(&pool), numReaders(0), epoch(0), numRetired{0, 0, 0} {
+  for(int i = 0; i < kMaxReaders; ++i) readers[i].pinned.store(0);
+}
+
+FragmentPool& EpochReclaimer::getPool() {
+  return *pool;
+}
+
+EpochReclaimer::~EpochReclaimer() {
+  for(int list = 0; list < 3; ++list) deallocateRetired(list);
+}
+
+int EpochReclaimer::addReader() {
+  int reader = numReaders.fetch_add(1);
+  if(reader < kMaxReaders) return reader;
+  numReaders.fetch_sub(1);
+  return -1;
+}
+
+void EpochReclaimer::pin(int reader) {
+  // Acquire pairs with tryAdvance(), so the reader sees fragments
+  // unlinked before the epoch it pins to
+  uint64_t current = epoch.load(std::memory_order_acquire);
+  readers[reader].pinned.store(current << 1 | 1, std::memory_order_relaxed);
+  // Either tryAdvance() sees this reader pinned, or the reader sees
+  // every fragment unlinked before it checked
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochReclaimer::unpin(int reader) {
+  readers[reader].pinned.store(0, std::memory_order_release);
+}
+
+// The consumer retires a fragment after unlinking it from the queue
+void EpochReclaimer::retire(ByteQueueFragment* fragment) {
+  int list = epoch.load(std::memory_order_relaxed) % 3;
+  retired[list][numRetired[list]++] = pool->getIndexInPool(fragment);
+  reclaim();
+}
+
+void EpochReclaimer::reclaim() {
+  if(!tryAdvance()) return;
+  // Fragments retired two epochs before the new one
+  deallocateRetired((epoch.load(std::memory_order_relaxed) + 1) % 3);
+}
+
+// Advances the epoch if every pinned reader is pinned to the current one
+bool EpochReclaimer::tryAdvance() {
+  uint64_t current = epoch.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int count = numReaders.load(std::memory_order_relaxed);
+  if(count > kMaxReaders) count = kMaxReaders;
+  for(int i = 0; i < count; ++i) {
+    uint64_t pinned = readers[i].pinned.load(std::memory_order_acquire);
+    if(pinned != 0 && pinned >> 1 != current) return false;
+  }
+  epoch.store(current + 1, std::memory_order_release);
+  return true;
+}
+
+void EpochReclaimer::deallocateRetired(int list) {
+  for(size_t i = 0; i < numRetired[list]; ++i) {
+    pool->deallocate(pool->getPointerAtIndex(retired[list][i]));
+  }
+  numRetired[list] = 0;
+}
+
+/* * * * * * * * * * SPSC Queue * * * * * * * * * */
+/*
+SpscByteQueue has one producer thread and one consumer thread. The producer
+owns the back fragment and its b, the consumer owns the front fragment
+and its f.
+
+  - The producer writes bytes, then publishes them by storing b with
+    release. When the back fragment is full, it starts a new one and
+    links it by storing N with release.
+  - The consumer loads b and N with acquire, so it sees the bytes they
+    publish. Once it has drained a full fragment and N shows the producer
+    moved on, it frees the fragment.
+
+The queue always keeps at least one fragment, so the producer and consumer
+never have to agree on the queue being deallocated.
+
+A queue uses the static pool, or a pool given to it. It finds that pool at
+an offset from itself rather than through a pointer, so a queue placed in
+memory shared between processes, next to its pool, works in each process
+mapping it (see SharedQueue).
+
+With an EpochReclaimer, other threads can read the queue's bytes in
+place with peekSpans() while the consumer dequeues them: the consumer
+retires drained fragments to the reclaimer rather than deallocating them.
+The reclaimer must be for the queue's pool, or its fragments would be
+deallocated to another pool.
+*/
+//
+class SpscByteQueue {
+
+  public:
+    SpscByteQueue();
+    SpscByteQueue(FragmentPool& pool, bool isProcessShared);
+    ~SpscByteQueue();
+    SpscByteQueue(const SpscByteQueue&) = delete;
+    SpscByteQueue& operator=(const SpscByteQueue&) = delete;
+    // Producer
+    QueueError enqueue(unsigned char byte);
+    // Returns the number of bytes enqueued, fewer than len if the pool ran out
+    size_t enqueueBytes(const unsigned char* data, size_t len);
+    // Consumer
+    bool tryDequeue(unsigned char& byte);
+    // Returns the number of bytes dequeued into out
+    size_t dequeueBytes(unsigned char* out, size_t capacity);
+    // Like the above, but sleep up to timeout while the queue is empty
+    bool dequeueWait(unsigned char& byte, std::chrono::nanoseconds timeout);
+    size_t dequeueBytesWait(unsigned char* out, size_t capacity,
+                            std::chrono::nanoseconds timeout);
+    // Zero-copy: the readable bytes of the front fragment, valid until
+    // they are consumed. Empty if the queue is.
+    ByteSpan peek();
+    void consume(size_t n);
+    // Any thread, pinned to the reclaimer: the readable bytes as spans,
+    // which stay valid until the thread unpins. The consumer may have
+    // dequeued them since.
+    size_t peekSpans(ByteSpan* spans, size_t maxSpans);
+    // Consumer: retire drained fragments to reclaimer, for peekSpans().
+    // Returns false, leaving the reclaimer unchanged, if the reclaimer
+    // deallocates to another pool than the queue's.
+    bool setReclaimer(EpochReclaimer* reclaimer);
+    bool isEmpty();
+    // Signals fd (an eventfd) when the queue becomes readable after
+    // armReadableEvent(), which returns false if it already is readable.
+    // Ignored for a process-shared queue.
+    void setReadableEventFd(int fd);
+    bool armReadableEvent();
+
+  private:
+    FragmentPool& getPool();
+    ByteQueueFragment* getFragment(char idx);
+    ByteQueueFragment* startFragment();
+    ByteQueueFragment* findReadableFront();
+    intptr_t poolOffset;
+    // Each side on its own cache line, so they don't bounce it between cores
+    alignas(64) char backIdx;
+    alignas(64) char frontIdx;
+    EpochReclaimer* reclaimer;
+    alignas(64) Parker parker;
+};
+
+SpscByteQueue::SpscByteQueue()
+  : SpscByteQueue(ByteQueueFragment::pool, false) {}
+
+SpscByteQueue::SpscByteQueue(FragmentPool& pool, bool isProcessShared)
+  : poolOffset(reinterpret_cast<intptr_t>(&pool) -
+               reinterpret_cast<intptr_t>(this)),
+    reclaimer(nullptr), parker(isProcessShared) {
+  ByteQueueFragment* fragment = startFragment();
+  if(fragment == nullptr) on_out_of_memory();
+  backIdx = frontIdx = fragment == nullptr ? -1
+    : pool.getIndexInPool(fragment);
+}
+
+SpscByteQueue::~SpscByteQueue() {
+  if(frontIdx == -1) return;
+  getPool().deallocateChain(getFragment(frontIdx), nullptr);
+}
+
+QueueError SpscByteQueue::enqueue(unsigned char byte) {
+  return enqueueBytes(&byte, 1) == 1 ? QueueError::None
+                                     : QueueError::OutOfMemory;
+}
+
+size_t SpscByteQueue::enqueueBytes(const unsigned char* data, size_t len) {
+  if(backIdx == -1) return 0;
+  ByteQueueFragment* back = getFragment(backIdx);
+  size_t enqueued = 0;
+  while(enqueued < len) {
+    char b = back->getBackItemIdx(); // only the producer writes it
+    if(b == 27) {
+      ByteQueueFragment* newBack = startFragment();
+      if(newBack == nullptr) break;
+      backIdx = getPool().getIndexInPool(newBack);
+      // Fill the new fragment before linking it, so the consumer
+      // never finds it empty
+      size_t count = len - enqueued < 28 ? len - enqueued : 28;
+      memcpy(newBack->chunk.whenUsed.bytes, data + enqueued, count);
+      newBack->setBackItemIdx(count - 1);
+      back->publishNextFragmentIdx(backIdx);
+      back = newBack;
+      enqueued += count;
+      continue;
+    }
+    size_t count = len - enqueued < size_t(27 - b) ? len - enqueued : 27 - b;
+    memcpy(&back->chunk.whenUsed.bytes[b + 1], data + enqueued, count);
+    back->publishBackItemIdx(b + count);
+    enqueued += count;
+  }
+  if(enqueued > 0) parker.unpark();
+  return enqueued;
+}
+
+bool SpscByteQueue::tryDequeue(unsigned char& byte) {
+  return dequeueBytes(&byte, 1) == 1;
+}
+
+size_t SpscByteQueue::dequeueBytes(unsigned char* out, size_t capacity) {
+  size_t dequeued = 0;
+  while(dequeued < capacity) {
+    ByteQueueFragment* front = findReadableFront();
+    if(front == nullptr) break;
+    char f = front->getFrontItemIdx();
+    size_t count = front->loadBackItemIdx() - f + 1;
+    if(count > capacity - dequeued) count = capacity - dequeued;
+    memcpy(out + dequeued, &front->chunk.whenUsed.bytes[size_t(f)], count);
+    front->publishFrontItemIdx(f + count);
+    dequeued += count;
+  }
+  return dequeued;
+}
+
+bool SpscByteQueue::dequeueWait(unsigned char& byte,
+                                std::chrono::nanoseconds timeout) {
+  return dequeueBytesWait(&byte, 1, timeout) == 1;
+}
+
+size_t SpscByteQueue::dequeueBytesWait(unsigned char* out, size_t capacity,
+                                       std::chrono::nanoseconds timeout) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + timeout;
+  while(true) {
+    size_t dequeued = dequeueBytes(out, capacity);
+    if(dequeued > 0) return dequeued;
+    if(!parker.park([this] { return !isEmpty(); }, deadline)) return 0;
+  }
+}
+
+ByteSpan SpscByteQueue::peek() {
+  ByteQueueFragment* front = findReadableFront();
+  if(front == nullptr) return ByteSpan{nullptr, 0};
+  return front->getSpan(front->getFrontItemIdx(), front->loadBackItemIdx());
+}
+
+// Consumes up to n bytes, the ones peek() gave first
+void SpscByteQueue::consume(size_t n) {
+  while(n > 0) {
+    ByteQueueFragment* front = findReadableFront();
+    if(front == nullptr) break;
+    char f = front->getFrontItemIdx();
+    size_t count = front->loadBackItemIdx() - f + 1;
+    if(count > n) count = n;
+    front->publishFrontItemIdx(f + count);
+    n -= count;
+  }
+}
+
+size_t SpscByteQueue::peekSpans(ByteSpan* spans, size_t maxSpans) {
+  size_t numSpans = 0;
+  char idx = std::atomic_ref<char>(frontIdx).load(std::memory_order_acquire);
+  while(idx != -1 && numSpans < maxSpans) {
+    ByteQueueFragment* fragment = getFragment(idx);
+    // The producer fills a fragment before linking the next, so loading
+    // the link first gives its final b if there is a next
+    idx = fragment->loadNextFragmentIdx();
+    // Only the first span starts where the consumer is. It may dequeue
+    // past later fragments meanwhile, but their bytes stay valid, and
+    // starting them at 0 keeps the spans free of gaps.
+    char f = numSpans == 0 ? fragment->loadFrontItemIdx() : 0;
+    char b = fragment->loadBackItemIdx();
+    if(f <= b) spans[numSpans++] = fragment->getSpan(f, b);
+  }
+  return numSpans;
+}
+
+bool SpscByteQueue::setReclaimer(EpochReclaimer* reclaimer) {
+  if(reclaimer != nullptr && &reclaimer->getPool() != &getPool()) {
+    return false;
+  }
+  this->reclaimer = reclaimer;
+  return true;
+}
+
+bool SpscByteQueue::isEmpty() {
+  return findReadableFront() == nullptr;
+}
+
+void SpscByteQueue::setReadableEventFd(int fd) {
+  parker.setEventFd(fd);
+}
+
+bool SpscByteQueue::armReadableEvent() {
+  return parker.arm([this] { return !isEmpty(); });
+}
+
+FragmentPool& SpscByteQueue::getPool() {
+  return *reinterpret_cast<FragmentPool*>(
+    reinterpret_cast<intptr_t>(this) + poolOffset);
+}
+
+ByteQueueFragment* SpscByteQueue::getFragment(char idx) {
+  return getPool().getPointerAtIndex(idx);
+}
+
+// Allocates an empty back fragment
+ByteQueueFragment* SpscByteQueue::startFragment() {
+  ByteQueueFragment* fragment = getPool().tryAllocate();
+  if(fragment == nullptr) return nullptr;
+  fragment->setBackFragmentIdx(-1);
+  fragment->setNextFragmentIdx(-1);
+  fragment->setFrontItemIdx(0);
+  fragment->setBackItemIdx(-1);
+  return fragment;
+}
+
+// Returns the front fragment if it has bytes to read, moving past
+// (and freeing) a drained full fragment first. Returns nullptr if empty.
+ByteQueueFragment* SpscByteQueue::findReadableFront() {
+  if(frontIdx == -1) return nullptr;
+  ByteQueueFragment* front = getFragment(frontIdx);
+  char f = front->getFrontItemIdx();
+  if(f <= front->loadBackItemIdx()) return front;
+  if(f < 28) return nullptr;
+  char nextIdx = front->loadNextFragmentIdx();
+  if(nextIdx == -1) return nullptr;
+  // The producer has moved on, it no longer touches this fragment
+  std::atomic_ref<char>(frontIdx).store(nextIdx, std::memory_order_release);
+  if(reclaimer != nullptr) reclaimer->retire(front);
+  else getPool().deallocate(front);
+  // A linked fragment always has bytes
+  return getFragment(frontIdx);
+}
+
+/* * * * * * * * * * MPSC Queue * * * * * * * * * */
+/*
+MpscByteQueue has many producer threads and one consumer thread. Producers
+claim space in the back fragment by adding to one atomic tail word, which
+holds the back fragment's index and the number of bytes claimed in it:
+
+          ┌────────────────────────┬────────┐
+          │     bytes claimed      │  back  │ = 32 bits
+          └────────────────────────┴────────┘
+                    24                 8
+
+  - A producer whose claim fits writes its bytes, then adds their count
+    to the fragment's commit count (kept in B) with release.
+  - The one producer whose claim first runs past the end closes the
+    fragment. It sets b to the fragment's last claimed byte, points the
+    tail at a new fragment holding its own claim, and links the old one
+    to it by storing N with release.
+  - Producers whose claims start past the end wait for the new fragment
+    and claim again.
+  - The consumer reads a fragment's bytes once the commit count reaches
+    the bytes claimed, and frees it once it is closed and drained.
+
+Each claim is at most 28 bytes, so it always fits in a fresh fragment.
+enqueueBytes() splits longer runs into 28-byte pieces, and other
+producers' bytes may come between the pieces.
+*/
+//
+class MpscByteQueue {
+
+  public:
+    MpscByteQueue();
+    ~MpscByteQueue();
+    MpscByteQueue(const MpscByteQueue&) = delete;
+    MpscByteQueue& operator=(const MpscByteQueue&) = delete;
+    // Producers
+    QueueError enqueue(unsigned char byte);
+    // Returns the number of bytes enqueued, fewer than len if the pool ran out
+    size_t enqueueBytes(const unsigned char* data, size_t len);
+    // Consumer
+    bool tryDequeue(unsigned char& byte);
+    // Returns the number of bytes dequeued into out
+    size_t dequeueBytes(unsigned char* out, size_t capacity);
+    // Like the above, but sleep up to timeout while the queue is empty
+    bool dequeueWait(unsigned char& byte, std::chrono::nanoseconds timeout);
+    size_t dequeueBytesWait(unsigned char* out, size_t capacity,
+                            std::chrono::nanoseconds timeout);
+    bool isEmpty();
+    // Signals fd (an eventfd) when the queue becomes readable after
+    // armReadableEvent(), which returns false if it already is readable
+    void setReadableEventFd(int fd);
+    bool armReadableEvent();
+
+  private:
+    ByteQueueFragment* getFragment(char idx);
+    ByteQueueFragment* startFragment();
+    bool claim(const unsigned char* data, size_t len);
+    ByteQueueFragment* findReadableFront(char& end);
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) char frontIdx;
+    alignas(64) Parker parker;
+};
+
+MpscByteQueue::MpscByteQueue() {
+  ByteQueueFragment* fragment = startFragment();
+  if(fragment == nullptr) on_out_of_memory();
+  frontIdx = fragment == nullptr ? -1
+    : ByteQueueFragment::pool.getIndexInPool(fragment);
+  tail.store(uint8_t(frontIdx));
+}
+
+MpscByteQueue::~MpscByteQueue() {
+  if(frontIdx == -1) return;
+  ByteQueueFragment::pool.deallocateChain(getFragment(frontIdx), nullptr);
+}
+
+QueueError MpscByteQueue::enqueue(unsigned char byte) {
+  return enqueueBytes(&byte, 1) == 1 ? QueueError::None
+                                     : QueueError::OutOfMemory;
+}
+
+size_t MpscByteQueue::enqueueBytes(const unsigned char* data, size_t len) {
+  // (frontIdx belongs to the consumer, the tail has no fragment either)
+  if((tail.load(std::memory_order_relaxed) & 0xff) == 0xff) return 0;
+  size_t enqueued = 0;
+  while(enqueued < len) {
+    size_t count = len - enqueued < 28 ? len - enqueued : 28;
+    if(!claim(data + enqueued, count)) break;
+    enqueued += count;
+  }
+  if(enqueued > 0) parker.unpark();
+  return enqueued;
+}
+
+bool MpscByteQueue::tryDequeue(unsigned char& byte) {
+  return dequeueBytes(&byte, 1) == 1;
+}
+
+size_t MpscByteQueue::dequeueBytes(unsigned char* out, size_t capacity) {
+  size_t dequeued = 0;
+  char end;
+  while(dequeued < capacity) {
+    ByteQueueFragment* front = findReadableFront(end);
+    if(front == nullptr) break;
+    char f = front->getFrontItemIdx();
+    size_t count = end - f;
+    if(count > capacity - dequeued) count = capacity - dequeued;
+    memcpy(out + dequeued, &front->chunk.whenUsed.bytes[size_t(f)], count);
+    front->setFrontItemIdx(f + count);
+    dequeued += count;
+  }
+  return dequeued;
+}
+
+bool MpscByteQueue::dequeueWait(unsigned char& byte,
+                                std::chrono::nanoseconds timeout) {
+  return dequeueBytesWait(&byte, 1, timeout) == 1;
+}
+
+size_t MpscByteQueue::dequeueBytesWait(unsigned char* out, size_t capacity,
+                                       std::chrono::nanoseconds timeout) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + timeout;
+  while(true) {
+    size_t dequeued = dequeueBytes(out, capacity);
+    if(dequeued > 0) return dequeued;
+    if(!parker.park([this] { return !isEmpty(); }, deadline)) return 0;
+  }
+}
+
+bool MpscByteQueue::isEmpty() {
+  char end;
+  return findReadableFront(end) == nullptr;
+}
+
+void MpscByteQueue::setReadableEventFd(int fd) {
+  parker.setEventFd(fd);
+}
+
+bool MpscByteQueue::armReadableEvent() {
+  return parker.arm([this] { return !isEmpty(); });
+}
+
+ByteQueueFragment* MpscByteQueue::getFragment(char idx) {
+  return ByteQueueFragment::pool.getPointerAtIndex(idx);
+}
+
+// Allocates an empty back fragment with no bytes committed
+ByteQueueFragment* MpscByteQueue::startFragment() {
+  ByteQueueFragment* fragment = ByteQueueFragment::pool.tryAllocate();
+  if(fragment == nullptr) return nullptr;
+  fragment->setBackFragmentIdx(0);
+  fragment->setNextFragmentIdx(-1);
+  fragment->setFrontItemIdx(0);
+  fragment->setBackItemIdx(-1);
+  return fragment;
+}
+
+// Claims len (at most 28) bytes at the back and writes data into them.
+// Returns false if a new fragment was needed and the pool had none.
+bool MpscByteQueue::claim(const unsigned char* data, size_t len) {
+  while(true) {
+    uint32_t old = tail.fetch_add(len << 8, std::memory_order_acq_rel);
+    ByteQueueFragment* back = getFragment(old & 0xff);
+    size_t start = old >> 8;
+    if(start + len <= 28) {
+      memcpy(&back->chunk.whenUsed.bytes[start], data, len);
+      back->addCommitCount(len);
+      return true;
+    }
+    if(start > 28) {
+      // Another producer is closing the fragment
+      while(tail.load(std::memory_order_relaxed) >> 8 > 28) {
+        std::this_thread::yield();
+      }
+      continue;
+    }
+    // This claim is the first not to fit, so this producer closes it
+    ByteQueueFragment* newBack = startFragment();
+    if(newBack == nullptr) {
+      // Reopen the fragment, dropping the claims made since
+      tail.store(old, std::memory_order_release);
+      return false;
+    }
+    char newBackIdx = ByteQueueFragment::pool.getIndexInPool(newBack);
+    memcpy(newBack->chunk.whenUsed.bytes, data, len);
+    newBack->setBackFragmentIdx(len);
+    back->setBackItemIdx(start - 1);
+    tail.store(uint8_t(newBackIdx) | len << 8, std::memory_order_release);
+    back->publishNextFragmentIdx(newBackIdx);
+    return true;
+  }
+}
+
+// Returns the front fragment and sets end past its readable bytes, moving
+// past (and freeing) a drained closed fragment first. Returns nullptr if
+// there is nothing to read yet.
+ByteQueueFragment* MpscByteQueue::findReadableFront(char& end) {
+  if(frontIdx == -1) return nullptr;
+  while(true) {
+    ByteQueueFragment* front = getFragment(frontIdx);
+    char f = front->getFrontItemIdx();
+    // Every committed byte was claimed before, so with the commit count
+    // loaded first, a matching claim count means every claim is committed
+    char committed = front->loadCommitCount();
+    char nextIdx = front->loadNextFragmentIdx();
+    if(nextIdx != -1) {
+      // Closed, b was set before it was linked
+      char size = front->getBackItemIdx() + 1;
+      if(committed != size) return nullptr;
+      if(f < size) {
+        end = size;
+        return front;
+      }
+      // No producer touches a closed fragment once it's all committed
+      ByteQueueFragment::pool.deallocate(front);
+      frontIdx = nextIdx;
+      continue;
+    }
+    uint32_t current = tail.load(std::memory_order_acquire);
+    // Being closed, wait for the link
+    if(char(current & 0xff) != frontIdx) return nullptr;
+    if(uint32_t(committed) != current >> 8 || f == committed) return nullptr;
+    end = committed;
+    return front;
+  }
+}
+
+/* * * * * * * * * * Fragment Channel * * * * * * * * * */
+/*
+FragmentChannel passes whole fragments from one producer thread to one
+consumer thread, so the threads synchronize once per fragment instead of
+once per byte.
+
+  - The producer fills a fragment the consumer can't see yet. When it is
+    full, or on flush(), the producer publishes it by linking it after
+    the last published fragment, storing N with release.
+  - The consumer loads N with acquire, reads the fragment's bytes, and
+    keeps drained fragments until it has a batch to free at once.
+  - The producer likewise takes fragments from the pool in batches.
+
+The consumer starts at an empty fragment, so there is always one to link to.
+*/
+//
+class FragmentChannel {
+
+  public:
+    FragmentChannel();
+    ~FragmentChannel();
+    FragmentChannel(const FragmentChannel&) = delete;
+    FragmentChannel& operator=(const FragmentChannel&) = delete;
+    // Producer
+    // Returns the number of bytes sent, fewer than len if the pool ran out
+    size_t send(const unsigned char* data, size_t len);
+    // Publishes the bytes sent so far, even if their fragment isn't full
+    void flush();
+    // Consumer
+    // Returns the number of bytes received into out
+    size_t receive(unsigned char* out, size_t capacity);
+    // Like receive(), but sleeps up to timeout while nothing is published
+    size_t receiveWait(unsigned char* out, size_t capacity,
+                       std::chrono::nanoseconds timeout);
+    bool isEmpty();
+    // Signals fd (an eventfd) when the queue becomes readable after
+    // armReadableEvent(), which returns false if it already is readable
+    void setReadableEventFd(int fd);
+    bool armReadableEvent();
+
+  private:
+    static const size_t kBatchSize = 8;
+    ByteQueueFragment* getFragment(char idx);
+    ByteQueueFragment* startFragment();
+    ByteQueueFragment* findReadableFront();
+    // Producer
+    alignas(64) ByteQueueFragment* filling;
+    ByteQueueFragment* spares;
+    char lastIdx;
+    // Consumer
+    alignas(64) char frontIdx;
+    ByteQueueFragment* drained;
+    size_t numDrained;
+    alignas(64) Parker parker;
+};
+
+FragmentChannel::FragmentChannel()
+  : filling(nullptr), spares(nullptr), drained(nullptr), numDrained(0) {
+  ByteQueueFragment* fragment = startFragment();
+  if(fragment == nullptr) on_out_of_memory();
+  lastIdx = frontIdx = fragment == nullptr ? -1
+    : ByteQueueFragment::pool.getIndexInPool(fragment);
+}
+
+FragmentChannel::~FragmentChannel() {
+  if(filling != nullptr) ByteQueueFragment::pool.deallocate(filling);
+  ByteQueueFragment::pool.deallocateBatch(spares);
+  ByteQueueFragment::pool.deallocateBatch(drained);
+  if(frontIdx == -1) return;
+  ByteQueueFragment::pool.deallocateChain(getFragment(frontIdx), nullptr);
+}
+
+size_t FragmentChannel::send(const unsigned char* data, size_t len) {
+  if(lastIdx == -1) return 0;
+  size_t sent = 0;
+  while(sent < len) {
+    if(filling == nullptr) {
+      filling = startFragment();
+      if(filling == nullptr) break;
+    }
+    char b = filling->getBackItemIdx();
+    size_t count = len - sent < size_t(27 - b) ? len - sent : 27 - b;
+    memcpy(&filling->chunk.whenUsed.bytes[b + 1], data + sent, count);
+    filling->setBackItemIdx(b + count);
+    sent += count;
+    if(filling->isBackItemAtEnd()) flush();
+  }
+  return sent;
+}
+
+void FragmentChannel::flush() {
+  if(filling == nullptr) return;
+  char fillingIdx = ByteQueueFragment::pool.getIndexInPool(filling);
+  getFragment(lastIdx)->publishNextFragmentIdx(fillingIdx);
+  lastIdx = fillingIdx;
+  filling = nullptr;
+  parker.unpark();
+}
+
+size_t FragmentChannel::receive(unsigned char* out, size_t capacity) {
+  size_t received = 0;
+  while(received < capacity) {
+    ByteQueueFragment* front = findReadableFront();
+    if(front == nullptr) break;
+    char f = front->getFrontItemIdx();
+    size_t count = front->getBackItemIdx() - f + 1;
+    if(count > capacity - received) count = capacity - received;
+    memcpy(out + received, &front->chunk.whenUsed.bytes[size_t(f)], count);
+    front->setFrontItemIdx(f + count);
+    received += count;
+  }
+  return received;
+}
+
+size_t FragmentChannel::receiveWait(unsigned char* out, size_t capacity,
+                                    std::chrono::nanoseconds timeout) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + timeout;
+  while(true) {
+    size_t received = receive(out, capacity);
+    if(received > 0) return received;
+    if(!parker.park([this] { return !isEmpty(); }, deadline)) return 0;
+  }
+}
+
+bool FragmentChannel::isEmpty() {
+  return findReadableFront() == nullptr;
+}
+
+void FragmentChannel::setReadableEventFd(int fd) {
+  parker.setEventFd(fd);
+}
+
+bool FragmentChannel::armReadableEvent() {
+  return parker.arm([this] { return !isEmpty(); });
+}
+
+ByteQueueFragment* FragmentChannel::getFragment(char idx) {
+  return ByteQueueFragment::pool.getPointerAtIndex(idx);
+}
+
+// Takes an empty fragment from the producer's spares,
+// refilling them from the pool in one batch
+ByteQueueFragment* FragmentChannel::startFragment() {
+  if(spares == nullptr) {
+    size_t allocated;
+    spares = ByteQueueFragment::pool.allocateBatch(kBatchSize, allocated);
+    if(spares == nullptr) return nullptr;
+  }
+  ByteQueueFragment* fragment = spares;
+  spares = spares->getNextFree();
+  fragment->setBackFragmentIdx(-1);
+  fragment->setNextFragmentIdx(-1);
+  fragment->setFrontItemIdx(0);
+  fragment->setBackItemIdx(-1);
+  return fragment;
+}
+
+// Returns the front fragment if it has bytes to read, moving past drained
+// fragments first. Returns nullptr if nothing is published.
+ByteQueueFragment* FragmentChannel::findReadableFront() {
+  if(frontIdx == -1) return nullptr;
+  while(true) {
+    ByteQueueFragment* front = getFragment(frontIdx);
+    if(front->getFrontItemIdx() <= front->getBackItemIdx()) return front;
+    char nextIdx = front->loadNextFragmentIdx();
+    if(nextIdx == -1) return nullptr;
+    // The producer no longer touches a fragment once it's linked past
+    ByteQueueFragment::pool.eraseFragment(front);
+    front->setNextFree(drained);
+    drained = front;
+    if(++numDrained == kBatchSize) {
+      ByteQueueFragment::pool.deallocateBatch(drained);
+      drained = nullptr;
+      numDrained = 0;
+    }
+    frontIdx = nextIdx;
+  }
+}
+
+/* * * * * * * * * * Drain Executor * * * * * * * * * */
+/*
+DrainExecutor drains many SPSC queues with a pool of worker threads.
+Producers call notify() after enqueuing; a queue with bytes is then
+claimed and put on a worker's deque.
+
+  - A worker takes queues from the back of its own deque. An idle worker
+    steals from the front of another worker's deque.
+  - A queue is drained for up to one quantum of bytes, then goes back on
+    the worker's deque if it still has bytes.
+  - Each queue counts the notify() calls since it was last drained empty.
+    Only the call that finds the count at zero schedules the queue, and
+    a worker that drained it empty only resets the count if it hasn't
+    changed since it started, so no notify() is lost.
+
+A queue is on a deque or being drained only while its count is above
+zero, so at most one worker drains it at a time and is its one consumer.
+
+Checking a queue for bytes is O(1), so claiming never walks fragments.
+Each queue keeps at least one fragment, so the 64-fragment pool bounds
+the number of queues, and leaves less room for bytes the more there are.
+*/
+//
+// Called with bytes drained from the queue attached as slot
+typedef void (*DrainFn)(int slot, const unsigned char* data, size_t len,
+                        void* context);
+
+class DrainExecutor {
+
+  public:
+    DrainExecutor(DrainFn drain, void* context);
+    ~DrainExecutor();
+    DrainExecutor(const DrainExecutor&) = delete;
+    DrainExecutor& operator=(const DrainExecutor&) = delete;
+    // Returns the slot of the attached queue, or -1 if all 64 are taken.
+    // Queues are attached before start().
+    int attach(SpscByteQueue& queue);
+    // Producer: schedules the slot's queue after bytes were enqueued.
+    // May run while start() changes the number of workers.
+    void notify(int slot);
+    void start(int numWorkers);
+    // Stops the workers once they finish their current queue,
+    // leaving any other bytes queued
+    void stop();
+
+  private:
+    static const int kMaxWorkers = 16;
+    static const size_t kQuantum = 1024;
+    // Each on its own cache line, as producers notify different slots
+    struct alignas(64) Slot {
+      SpscByteQueue* queue;
+      std::atomic<uint32_t> notifications;
+    };
+    struct alignas(64) Worker {
+      std::mutex mutex;
+      std::deque<char> slots;
+      std::thread thread;
+    };
+    void work(int self);
+    int takeSlot(int self);
+    void push(int worker, int slot);
+    void moveSlots(int fromWorker, int toWorker);
+    void drainSlot(int self, int slot);
+    DrainFn drain;
+    void* context;
+    Slot slots[64];
+    int numSlots;
+    Worker workers[kMaxWorkers];
+    std::atomic<int> numWorkers;
+    std::atomic<bool> isRunning;
+};
+
+DrainExecutor::DrainExecutor(DrainFn drain, void* context)
+  : drain(drain), context(context), numSlots(0), numWorkers(0),
+    isRunning(false) {}
+
+DrainExecutor::~DrainExecutor() {
+  stop();
+}
+
+int DrainExecutor::attach(SpscByteQueue& queue) {
+  if(numSlots == 64) return -1;
+  slots[numSlots].queue = &queue;
+  slots[numSlots].notifications.store(0);
+  return numSlots++;
+}
+
+void DrainExecutor::notify(int slot) {
+  if(slots[slot].notifications.fetch_add(1, std::memory_order_acq_rel) > 0) {
+    return;
+  }
+  int numWorkers = this->numWorkers.load();
+  int worker = numWorkers > 0 ? slot % numWorkers : 0;
+  push(worker, slot);
+  // A start() with fewer workers may have moved the orphaned queues
+  // before this push: either it saw the slot, or this sees its count
+  if(worker > 0 && worker >= this->numWorkers.load()) moveSlots(worker, 0);
+}
+
+void DrainExecutor::start(int numWorkers) {
+  if(isRunning.load()) return;
+  if(numWorkers > kMaxWorkers) numWorkers = kMaxWorkers;
+  if(numWorkers < 1) numWorkers = 1;
+  this->numWorkers.store(numWorkers);
+  // Queues left on workers a previous start() had and this one doesn't
+  for(int i = numWorkers; i < kMaxWorkers; ++i) moveSlots(i, 0);
+  isRunning.store(true);
+  for(int i = 0; i < numWorkers; ++i) {
+    workers[i].thread = std::thread([this, i] { work(i); });
+  }
+  // Pick up queues that already had bytes
+  for(int slot = 0; slot < numSlots; ++slot) notify(slot);
+}
+
+void DrainExecutor::stop() {
+  if(!isRunning.exchange(false)) return;
+  int numWorkers = this->numWorkers.load();
+  for(int i = 0; i < numWorkers; ++i) workers[i].thread.join();
+}
+
+void DrainExecutor::work(int self) {
+  int idleTurns = 0;
+  while(isRunning.load(std::memory_order_relaxed)) {
+    int slot = takeSlot(self);
+    if(slot != -1) {
+      idleTurns = 0;
+      drainSlot(self, slot);
+      continue;
+    }
+    // Nothing to drain or steal, back off
+    if(++idleTurns < 64) {
+      std::this_thread::yield();
+    }
+    else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+}
+
+// Takes a slot from the back of the worker's own deque, or steals one
+// from the front of another's. Returns -1 if all are empty.
+int DrainExecutor::takeSlot(int self) {
+  {
+    std::lock_guard<std::mutex> lock(workers[self].mutex);
+    if(!workers[self].slots.empty()) {
+      int slot = workers[self].slots.back();
+      workers[self].slots.pop_back();
+      return slot;
+    }
+  }
+  int numWorkers = this->numWorkers.load(std::memory_order_relaxed);
+  for(int i = 1; i < numWorkers; ++i) {
+    Worker& victim = workers[(self + i) % numWorkers];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if(!victim.slots.empty()) {
+      int slot = victim.slots.front();
+      victim.slots.pop_front();
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void DrainExecutor::push(int worker, int slot) {
+  std::lock_guard<std::mutex> lock(workers[worker].mutex);
+  workers[worker].slots.push_back(slot);
+}
+
+void DrainExecutor::moveSlots(int fromWorker, int toWorker) {
+  std::scoped_lock lock(workers[fromWorker].mutex, workers[toWorker].mutex);
+  for(char slot : workers[fromWorker].slots) {
+    workers[toWorker].slots.push_back(slot);
+  }
+  workers[fromWorker].slots.clear();
+}
+
+void DrainExecutor::drainSlot(int self, int slot) {
+  SpscByteQueue& queue = *slots[slot].queue;
+  uint32_t notifications =
+    slots[slot].notifications.load(std::memory_order_acquire);
+  unsigned char chunk[256];
+  size_t drained = 0;
+  while(drained < kQuantum) {
+    size_t n = queue.dequeueBytes(chunk, sizeof(chunk));
+    if(n == 0) break;
+    drain(slot, chunk, n, context);
+    drained += n;
+  }
+  if(!queue.isEmpty()) {
+    push(self, slot);
+    return;
+  }
+  // A notify() since the count was loaded may be for bytes enqueued
+  // after the check above, so drain again
+  if(!slots[slot].notifications.compare_exchange_strong(
+       notifications, 0, std::memory_order_acq_rel)) {
+    push(self, slot);
+  }
+}
+
+/* * * * * * * * * * Locked Queue * * * * * * * * * */
+/*
+LockedByteQueue is a ByteQueue any thread can use, with a spinlock of its
+own. The lock and the front pointer share one cache line, the queue's
+control block, so threads using different queues never touch the same
+line or wait on each other: the pool they share is lock-free. Any number
+of threads can use one queue, taking turns.
+
+Its operations are ByteQueue's, run under the lock. withLock() runs any
+other operation on the queue's front under it. Other threads spin while
+it runs, so it should be short and never wait on another thread. The
+queue operations qualify: when the pool runs out they return an error
+rather than wait for fragments.
+*/
+//
+class alignas(64) LockedByteQueue {
+
+  public:
+    LockedByteQueue() : isLocked(false), front(nullptr) {}
+    ~LockedByteQueue() { ::destroy_queue(front); }
+    LockedByteQueue(const LockedByteQueue&) = delete;
+    LockedByteQueue& operator=(const LockedByteQueue&) = delete;
+    QueueError enqueue(unsigned char byte);
+    // Returns the number of bytes enqueued, fewer than len if the pool ran out
+    size_t enqueueBytes(const unsigned char* data, size_t len);
+    bool tryDequeue(unsigned char& byte);
+    // Returns the number of bytes dequeued into out
+    size_t dequeueBytes(unsigned char* out, size_t capacity);
+    size_t size();
+    bool isEmpty();
+    // Runs operation(front) with the queue locked, returning its result.
+    // operation must not wait on other threads, they spin meanwhile.
+    template <typename Operation>
+    decltype(auto) withLock(Operation operation);
+
+  private:
+    void lock();
+    void unlock();
+    std::atomic<bool> isLocked;
+    ByteQueueFragment* front;
+};
+
+QueueError LockedByteQueue::enqueue(unsigned char byte) {
+  return enqueueBytes(&byte, 1) == 1 ? QueueError::None
+                                     : QueueError::OutOfMemory;
+}
+
+size_t LockedByteQueue::enqueueBytes(const unsigned char* data, size_t len) {
+  lock();
+  ByteSpan spans[8];
+  size_t enqueued = 0;
+  while(enqueued < len) {
+    // Other threads share the pool, stop quietly when it runs out
+    size_t numSpans = try_reserve_spans(front, spans, 8);
+    if(numSpans == 0) break;
+    size_t copied = 0;
+    for(size_t i = 0; i < numSpans && enqueued + copied < len; ++i) {
+      size_t count = len - enqueued - copied;
+      if(count > spans[i].len) count = spans[i].len;
+      memcpy(spans[i].data, data + enqueued + copied, count);
+      copied += count;
+    }
+    commit(front, copied);
+    enqueued += copied;
+  }
+  unlock();
+  return enqueued;
+}
+
+bool LockedByteQueue::tryDequeue(unsigned char& byte) {
+  lock();
+  bool isDequeued = try_dequeue_byte(front, byte);
+  unlock();
+  return isDequeued;
+}
+
+size_t LockedByteQueue::dequeueBytes(unsigned char* out, size_t capacity) {
+  lock();
+  size_t dequeued = copy_out(front, 0, capacity, out);
+  skip(front, dequeued);
+  unlock();
+  return dequeued;
+}
+
+size_t LockedByteQueue::size() {
+  lock();
+  size_t size = queue_size(front);
+  unlock();
+  return size;
+}
+
+bool LockedByteQueue::isEmpty() {
+  lock();
+  bool isEmpty = queue_empty(front);
+  unlock();
+  return isEmpty;
+}
+
+template <typename Operation>
+decltype(auto) LockedByteQueue::withLock(Operation operation) {
+  // Unlocks on return, after the result is made
+  struct Unlock {
+    LockedByteQueue* queue;
+    ~Unlock() { queue->unlock(); }
+  };
+  lock();
+  Unlock unlock{this};
+  return operation(front);
+}
+
+// Spins on a plain load, so waiting threads don't take the line from the
+// holder, and yields once the holder seems to have been descheduled
+void LockedByteQueue::lock() {
+  int spins = 0;
+  while(isLocked.exchange(true, std::memory_order_acquire)) {
+    while(isLocked.load(std::memory_order_relaxed)) {
+      if(++spins < 64) {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+        continue;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+
+void LockedByteQueue::unlock() {
+  isLocked.store(false, std::memory_order_release);
+}
+
+
+/*********/
+/* I / O */
+/*********/
+#ifdef __linux__
+/*
+Queues can be pumped to and from file descriptors (pipes, sockets) without
+copying through an intermediate buffer: reads land directly in reserved
+fragment spans and writes are gathered from readable spans.
+
+    pump_readv / pump_writev   one readv/writev system call per queue
+    EpollPump                  many queues driven by one epoll instance
+    IoUringEngine              many queues driven by one io_uring, batching
+                               every read and write into one submission
+
+The pool only holds 64 fragments, so the number of queues a host can drive
+at once is bounded by the pool, not by the engines.
+*/
+//
+const size_t kMaxIoSpans = 8;
+
+// Reads from fd into the back of the queue. Returns the readv result,
+// or -1 with errno = ENOBUFS when no fragment could be reserved. A full
+// pool is backpressure rather than an error, so it isn't reported.
+ssize_t pump_readv(int fd, ByteQueueFragment*& front) {
+  ByteSpan spans[kMaxIoSpans];
+  struct iovec iov[kMaxIoSpans];
+  size_t numSpans = try_reserve_spans(front, spans, kMaxIoSpans);
+  if(numSpans == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  for(size_t i = 0; i < numSpans; ++i) {
+    iov[i].iov_base = spans[i].data;
+    iov[i].iov_len = spans[i].len;
+  }
+  ssize_t bytesRead = readv(fd, iov, numSpans);
+  commit(front, bytesRead > 0 ? bytesRead : 0);
+  return bytesRead;
+}
+
+// Writes from the front of the queue to fd, consuming what was written.
+// Returns the writev result, or 0 if the queue is empty.
+ssize_t pump_writev(int fd, ByteQueueFragment*& front) {
+  ByteSpan spans[kMaxIoSpans];
+  struct iovec iov[kMaxIoSpans];
+  size_t numSpans = readable_spans(front, spans, kMaxIoSpans);
+  if(numSpans == 0) return 0;
+  for(size_t i = 0; i < numSpans; ++i) {
+    iov[i].iov_base = spans[i].data;
+    iov[i].iov_len = spans[i].len;
+  }
+  ssize_t bytesWritten = writev(fd, iov, numSpans);
+  if(bytesWritten > 0) skip(front, bytesWritten);
+  return bytesWritten;
+}
+
+
+/* * * * * * * * * * Shared Memory * * * * * * * * * */
+/*
+A SharedQueue is an SpscByteQueue with a pool of its own, in a memfd
+mapped by two processes. One process creates it and hands the fd to the
+other (through fork() or over a Unix socket), which opens it. Then one
+process produces and the other consumes, reading the bytes with peek()
+where the producer wrote them, without copies.
+
+Nothing in the mapping is a pointer: fragments link by index and the
+queue finds its pool by offset, so each process may map it at a different
+address. The atomics in it are lock-free, which makes them work across
+processes, and the queue's Parker waits on a shared futex. Eventfds set
+on the queue or its pool are ignored, since the fd numbers would be read
+by a process that doesn't have them.
+*/
+//
+struct SharedQueue {
+  SharedQueue() : pool(true), queue(pool, true) {}
+  FragmentPool pool;
+  SpscByteQueue queue;
+};
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "a shared pool needs address-free atomics");
+
+// Creates a SharedQueue in a new memfd, which fd is set to.
+// Returns nullptr on failure.
+SharedQueue* create_shared_queue(int& fd) {
+  fd = memfd_create("ByteQueue", MFD_CLOEXEC);
+  if(fd == -1) return nullptr;
+  if(ftruncate(fd, sizeof(SharedQueue)) == -1) {
+    close(fd);
+    return nullptr;
+  }
+  void* memory = mmap(nullptr, sizeof(SharedQueue), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  if(memory == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  return new(memory) SharedQueue();
+}
+
+// Maps the SharedQueue another process created in fd.
+// Returns nullptr on failure.
+SharedQueue* open_shared_queue(int fd) {
+  void* memory = mmap(nullptr, sizeof(SharedQueue), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  if(memory == MAP_FAILED) return nullptr;
+  return static_cast<SharedQueue*>(memory);
+}
+
+// Unmaps the queue in this process. Its memory is freed once every
+// process unmapped it and closed the fd.
+void close_shared_queue(SharedQueue* shared) {
+  munmap(shared, sizeof(SharedQueue));
+}
+
+
+/* * * * * * * * * * Events * * * * * * * * * */
+
+// Signals fd (an eventfd) when the pool's free fragments drop below
+// threshold, so an event loop can stop reading before the pool runs out
+void set_low_free_event_fd(int fd, size_t threshold) {
+  ByteQueueFragment::pool.setLowFreeEventFd(fd, threshold);
+}
+
+
+/* * * * * * * * * * Epoll Pump * * * * * * * * * */
+
+// Each fd is bound to one queue in each direction: a socket may have both
+// a reader and a writer, sharing one registration. The fds must be
+// non-blocking, they are registered edge-triggered.
+class EpollPump {
+
+  public:
+    EpollPump();
+    ~EpollPump();
+    int addReader(int fd, ByteQueueFragment*& front);
+    int addWriter(int fd, ByteQueueFragment*& front);
+    // Waits up to timeoutMs for readiness, then pumps every ready binding
+    // until it would block. Returns the number of bytes moved.
+    size_t runOnce(int timeoutMs);
+    bool isClosed(int id);
+
+  private:
+    struct Binding {
+      int fd;
+      ByteQueueFragment** queue;
+      bool isReader;
+      bool isReady;
+      bool isClosed;
+      // The binding for the other direction on the same fd, -1 if none
+      int otherId;
+    };
+    int addBinding(int fd, ByteQueueFragment*& front, bool isReader);
+    void setReady(int id, uint32_t events);
+    size_t pump(Binding& binding);
+    int epollFd;
+    std::vector<Binding> bindings;
+};
+
+EpollPump::EpollPump() {
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+EpollPump::~EpollPump() {
+  if(epollFd >= 0) close(epollFd);
+}
+
+int EpollPump::addReader(int fd, ByteQueueFragment*& front) {
+  return addBinding(fd, front, true);
+}
+
+int EpollPump::addWriter(int fd, ByteQueueFragment*& front) {
+  return addBinding(fd, front, false);
+}
+
+int EpollPump::addBinding(int fd, ByteQueueFragment*& front, bool isReader) {
+  int id = bindings.size();
+  int otherId = -1;
+  for(int i = 0; i < id; ++i) {
+    if(bindings[i].fd != fd) continue;
+    if(bindings[i].isReader == isReader) {
+      errno = EEXIST;
+      return -1;
+    }
+    otherId = i;
+  }
+  // An fd bound in the other direction already is registered, under the
+  // other binding's id, and now waits for both
+  struct epoll_event event;
+  event.events = (isReader ? EPOLLIN : EPOLLOUT) | EPOLLET;
+  event.data.u32 = id;
+  int op = EPOLL_CTL_ADD;
+  if(otherId != -1) {
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u32 = otherId;
+    op = EPOLL_CTL_MOD;
+  }
+  if(epoll_ctl(epollFd, op, fd, &event) == -1) return -1;
+  bindings.push_back(Binding{fd, &front, isReader, false, false, otherId});
+  if(otherId != -1) bindings[otherId].otherId = id;
+  return id;
+}
+
+// Marks the binding ready if events concern its direction.
+// Errors and hang-ups concern both.
+void EpollPump::setReady(int id, uint32_t events) {
+  uint32_t mask = (bindings[id].isReader ? EPOLLIN : EPOLLOUT)
+                  | EPOLLERR | EPOLLHUP;
+  if(events & mask) bindings[id].isReady = true;
+}
+
+bool EpollPump::isClosed(int id) {
+  return bindings[id].isClosed;
+}
+
+size_t EpollPump::pump(Binding& binding) {
+  size_t moved = 0;
+  while(binding.isReady && !binding.isClosed) {
+    ssize_t result = binding.isReader 
+      ? pump_readv(binding.fd, *binding.queue)
+      : pump_writev(binding.fd, *binding.queue);
+    if(result > 0) {
+      moved += result;
+      continue;
+    }
+    // Writer with an empty queue, or reader with no fragments left.
+    // Stay ready, there is more to do once the queue changes.
+    if((result == 0 && !binding.isReader) || 
+       (result == -1 && errno == ENOBUFS)) break;
+    // Would block, wait for the next edge
+    if(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      binding.isReady = false;
+      break;
+    }
+    // End of file or error
+    binding.isClosed = true;
+  }
+  return moved;
+}
+
+size_t EpollPump::runOnce(int timeoutMs) {
+  struct epoll_event events[64];
+  int numEvents = epoll_wait(epollFd, events, 64, timeoutMs);
+  for(int i = 0; i < numEvents; ++i) {
+    int id = events[i].data.u32;
+    setReady(id, events[i].events);
+    if(bindings[id].otherId != -1) {
+      setReady(bindings[id].otherId, events[i].events);
+    }
+  }
+  size_t moved = 0;
+  for(Binding& binding : bindings) {
+    moved += pump(binding);
+  }
+  return moved;
+}
+
+
+/* * * * * * * * * * io_uring Engine * * * * * * * * * */
+
+// Each fd is bound to one queue in one direction. A queue may have both a
+// reader and a writer; their operations on it are never in flight together.
+// Reads fill fragments of their own, spliced onto the queue when they
+// complete, so the application may consume from a reader's queue between
+// runOnce() calls.
+// Uses the raw system calls, no liburing needed.
+class IoUringEngine {
+
+  public:
+    IoUringEngine(unsigned entries = 128);
+    ~IoUringEngine();
+    bool isValid();
+    int addReader(int fd, ByteQueueFragment*& front);
+    int addWriter(int fd, ByteQueueFragment*& front);
+    // Submits a read or write for every idle binding in one system call, 
+    // waits for at least minComplete completions and applies them to the
+    // queues. Returns the number of bytes moved.
+    size_t runOnce(unsigned minComplete = 1);
+    bool isClosed(int id);
+
+  private:
+    struct Binding {
+      int fd;
+      ByteQueueFragment** queue;
+      bool isReader;
+      bool isInFlight;
+      bool isClosed;
+      // Fragments a read in flight fills, not yet part of the queue
+      ByteQueueFragment* pending;
+      struct iovec iov[kMaxIoSpans];
+    };
+    int addBinding(int fd, ByteQueueFragment*& front, bool isReader);
+    bool isQueueBusy(ByteQueueFragment** queue);
+    bool prepare(int id);
+    size_t complete(struct io_uring_cqe* cqe);
+    int ringFd;
+    unsigned inFlight;
+    std::vector<Binding> bindings;
+    // Submission ring
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned sqPending;
+    // Completion ring
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+};
+
+IoUringEngine::IoUringEngine(unsigned entries) 
+  : ringFd(-1), inFlight(0), sqRing(MAP_FAILED), sqes(nullptr), 
+    sqPending(0), cqRing(MAP_FAILED) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(fd < 0) return;
+  // Map the rings, sharing one mapping for both if the kernel allows it
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = 
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool isSingleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(isSingleMmap && cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(sqRing == MAP_FAILED) { close(fd); return; }
+  cqRing = isSingleMmap ? sqRing : 
+    mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, 
+         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, 
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(cqRing == MAP_FAILED || sqesMap == MAP_FAILED) {
+    if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    sqRing = cqRing = MAP_FAILED;
+    close(fd);
+    return;
+  }
+  char* sq = static_cast<char*>(sqRing);
+  sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sqes = static_cast<struct io_uring_sqe*>(sqesMap);
+  char* cq = static_cast<char*>(cqRing);
+  cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  ringFd = fd;
+}
+
+IoUringEngine::~IoUringEngine() {
+  if(ringFd < 0) return;
+  // Closing the ring cancels anything still in flight
+  munmap(sqes, sqesSize);
+  if(cqRing != sqRing) munmap(cqRing, cqRingSize);
+  munmap(sqRing, sqRingSize);
+  close(ringFd);
+  for(Binding& binding : bindings) destroy_queue(binding.pending);
+}
+
+bool IoUringEngine::isValid() {
+  return ringFd >= 0;
+}
+
+int IoUringEngine::addReader(int fd, ByteQueueFragment*& front) {
+  return addBinding(fd, front, true);
+}
+
+int IoUringEngine::addWriter(int fd, ByteQueueFragment*& front) {
+  return addBinding(fd, front, false);
+}
+
+int IoUringEngine::addBinding(int fd, ByteQueueFragment*& front, 
+                              bool isReader) {
+  int id = bindings.size();
+  bindings.push_back(Binding{fd, &front, isReader, false, false, nullptr,
+                             {}});
+  return id;
+}
+
+bool IoUringEngine::isClosed(int id) {
+  return bindings[id].isClosed;
+}
+
+bool IoUringEngine::isQueueBusy(ByteQueueFragment** queue) {
+  for(Binding& binding : bindings) {
+    if(binding.queue == queue && binding.isInFlight) return true;
+  }
+  return false;
+}
+
+// Fills the next submission queue entry for binding id, if it has work
+bool IoUringEngine::prepare(int id) {
+  Binding& binding = bindings[id];
+  if(binding.isInFlight || binding.isClosed) return false;
+  if(isQueueBusy(binding.queue)) return false;
+  unsigned tail = *sqTail + sqPending;
+  if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) return false;
+  ByteSpan spans[kMaxIoSpans];
+  size_t numSpans = binding.isReader 
+    ? try_reserve_spans(binding.pending, spans, kMaxIoSpans)
+    : readable_spans(*binding.queue, spans, kMaxIoSpans);
+  if(numSpans == 0) return false;
+  for(size_t i = 0; i < numSpans; ++i) {
+    binding.iov[i].iov_base = spans[i].data;
+    binding.iov[i].iov_len = spans[i].len;
+  }
+  unsigned index = tail & *sqMask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = binding.isReader ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd = binding.fd;
+  sqe->addr = reinterpret_cast<unsigned long>(binding.iov);
+  sqe->len = numSpans;
+  sqe->user_data = id;
+  sqArray[index] = index;
+  binding.isInFlight = true;
+  ++sqPending;
+  ++inFlight;
+  return true;
+}
+
+// Appends a finished read to the queue or skips past a finished write
+size_t IoUringEngine::complete(struct io_uring_cqe* cqe) {
+  Binding& binding = bindings[cqe->user_data];
+  binding.isInFlight = false;
+  --inFlight;
+  int result = cqe->res;
+  size_t moved = result > 0 ? result : 0;
+  if(binding.isReader) {
+    // Also releases the reservation if nothing was read
+    commit(binding.pending, moved);
+    splice(*binding.queue, binding.pending);
+  }
+  else if(moved > 0) {
+    skip(*binding.queue, moved);
+  }
+  // End of file or error, except a non-blocking fd that would block
+  if((result == 0 && binding.isReader) || 
+     (result < 0 && result != -EAGAIN && result != -EINTR)) {
+    binding.isClosed = true;
+  }
+  return moved;
+}
+
+size_t IoUringEngine::runOnce(unsigned minComplete) {
+  if(ringFd < 0) return 0;
+  for(size_t id = 0; id < bindings.size(); ++id) {
+    prepare(id);
+  }
+  // Publish the new entries to the kernel
+  unsigned toSubmit = sqPending;
+  __atomic_store_n(sqTail, *sqTail + sqPending, __ATOMIC_RELEASE);
+  sqPending = 0;
+  if(minComplete > inFlight) minComplete = inFlight;
+  if(toSubmit > 0 || minComplete > 0) {
+    int result = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                         IORING_ENTER_GETEVENTS, nullptr, 0);
+    if(result < 0 && errno != EINTR) return 0;
+  }
+  // Reap completions
+  size_t moved = 0;
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for(; head != tail; ++head) {
+    moved += complete(&cqes[head & *cqMask]);
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  return moved;
+}
+
+#endif // __linux__
+
+
+
+/*****************/
+/* T E S T I N G */ 
+/*****************/
+
+void printDataBlock() {
+  // print j values
+  std::cout << "       j:";
+  for(int j = 0; j < 32; ++j) { printf("%4i", j); }
+  std::cout << '\n';
+  // print box top
+  std::cout << "        ┌─";
+  for(int j = 0; j < 32; ++j) { printf("────"); }
+  std::cout << '\n';
+  // print i labels
+  for(int i = 0; i < 64; ++i) {
+    // bool used = ByteQueueFragment::pool.used[i];
+    // std::string icon = used ? "●" : "○";
+    // printf("%s  i:%3i│", &icon, i);
+    bool used = true;       // when used array is commented out
+    printf("   i:%3i│", i); // when used array is commented out
+    // print bytes in row i
+    if(used) {
+      for(int j = 0; j < 32; ++j) {
+        unsigned char val = ByteQueueFragment::pool.data[32*i + j];
+        if(j < 4) {
+          printf("%4i", (char)val);
+          continue;
+        }
+        printf("%4i", val);
+      }
+    }
+    else {
+      for(int j = 0; j < 32; ++j) {
+        unsigned char val = ByteQueueFragment::pool.data[32*i + j];
+        printf("%4x", val);
+      }
+    }
+    std::cout << '\n';
+  }
+}
+
+#ifdef __linux__
+// Moves bytes through pairs of queues connected by socketpairs:
+// src[i] -> socket a[i] ~> socket b[i] -> dst[i]
+// comparing the readv/writev pump, epoll and io_uring.
+void benchmarkIoEngines() {
+  const int numPairs = 4;
+  const size_t bytesPerMethod = 8 << 20;
+  const char* names[] = {"readv/writev", "epoll", "io_uring"};
+  signal(SIGPIPE, SIG_IGN);
+  for(int method = 0; method < 3; ++method) {
+    int a[numPairs], b[numPairs];
+    ByteQueueFragment* src[numPairs] = {};
+    ByteQueueFragment* dst[numPairs] = {};
+    EpollPump epoll;
+    IoUringEngine uring;
+    for(int i = 0; i < numPairs; ++i) {
+      int pair[2];
+      socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+      a[i] = pair[0];
+      b[i] = pair[1];
+      if(method != 2) {
+        fcntl(a[i], F_SETFL, O_NONBLOCK);
+        fcntl(b[i], F_SETFL, O_NONBLOCK);
+      }
+      if(method == 1) {
+        epoll.addWriter(a[i], src[i]);
+        epoll.addReader(b[i], dst[i]);
+      }
+      if(method == 2) {
+        uring.addWriter(a[i], src[i]);
+        uring.addReader(b[i], dst[i]);
+      }
+    }
+    size_t received = 0;
+    auto start = std::chrono::steady_clock::now();
+    while(received < bytesPerMethod) {
+      // Refill sources with 3 fragments worth of bytes
+      for(int i = 0; i < numPairs; ++i) {
+        ByteSpan spans[3];
+        if(readable_spans(src[i], spans, 1) > 0) continue;
+        size_t numSpans = reserve_spans(src[i], spans, 3);
+        size_t filled = 0;
+        for(size_t s = 0; s < numSpans; ++s) {
+          memset(spans[s].data, 'x', spans[s].len);
+          filled += spans[s].len;
+        }
+        commit(src[i], filled);
+      }
+      if(method == 0) {
+        for(int i = 0; i < numPairs; ++i) {
+          pump_writev(a[i], src[i]);
+          pump_readv(b[i], dst[i]);
+        }
+      }
+      if(method == 1) epoll.runOnce(0);
+      if(method == 2) uring.runOnce(1);
+      // Discard what arrived
+      for(int i = 0; i < numPairs; ++i) {
+        received += skip(dst[i], bytesPerMethod);
+      }
+    }
+    std::chrono::duration<double> elapsed = 
+      std::chrono::steady_clock::now() - start;
+    printf("%-14s %8.1f MB/s\n", names[method], 
+           received / elapsed.count() / 1e6);
+    // Reads still in flight must finish before their fragments are freed,
+    // shutting down the sockets completes them with end of file.
+    for(int i = 0; i < numPairs; ++i) {
+      shutdown(a[i], SHUT_RDWR);
+      while(method == 2 && !uring.isClosed(2*i + 1)) uring.runOnce(1);
+    }
+    for(int i = 0; i < numPairs; ++i) {
+      close(a[i]);
+      close(b[i]);
+      destroy_queue(src[i]);
+      destroy_queue(dst[i]);
+    }
+  }
+}
+#endif
+
+// Moves 700 of 1000 bytes from one queue to another, with transfer()
+// and with dequeue_byte/enqueue_byte
+void benchmarkTransfer() {
+  const int rounds = 100000;
+  unsigned char data[1000];
+  memset(data, 'x', sizeof(data));
+  const char* names[] = {"transfer", "byte-by-byte"};
+  for(int method = 0; method < 2; ++method) {
+    ByteQueueFragment* a = nullptr;
+    ByteQueueFragment* b = nullptr;
+    std::chrono::duration<double> elapsed(0);
+    for(int round = 0; round < rounds; ++round) {
+      enqueue_bytes(a, data, sizeof(data));
+      auto start = std::chrono::steady_clock::now();
+      if(method == 0) {
+        transfer(a, b, 700);
+      }
+      else {
+        for(int i = 0; i < 700; ++i) enqueue_byte(b, dequeue_byte(a));
+      }
+      elapsed += std::chrono::steady_clock::now() - start;
+      destroy_queue(a);
+      destroy_queue(b);
+    }
+    printf("%-14s %8.1f ns per transfer\n", names[method], 
+           elapsed.count() / rounds * 1e9);
+  }
+}
+
+// Passes bytes from a producer thread to a consumer thread through
+// SpscByteQueue, and through a queue guarded by a mutex
+void benchmarkSpsc() {
+  const size_t total = 10000000;
+  const char* names[] = {"spsc", "spsc bulk", "mutex"};
+  for(int method = 0; method < 3; ++method) {
+    SpscByteQueue spsc;
+    ByteQueueFragment* locked = nullptr;
+    std::mutex mutex;
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&] {
+      unsigned char chunk[64];
+      memset(chunk, 'x', sizeof(chunk));
+      size_t sent = 0;
+      while(sent < total) {
+        size_t n = 0;
+        if(method == 0) n = spsc.enqueue('x') == QueueError::None;
+        if(method == 1) n = spsc.enqueueBytes(chunk, sizeof(chunk));
+        if(method == 2) {
+          std::lock_guard<std::mutex> lock(mutex);
+          n = enqueue_capacity(locked) > 0 &&
+              enqueue_byte(locked, 'x') == QueueError::None;
+        }
+        if(n == 0) std::this_thread::yield();
+        sent += n;
+      }
+    });
+    unsigned char chunk[64];
+    size_t received = 0;
+    while(received < total) {
+      size_t n = 0;
+      if(method == 0) n = spsc.tryDequeue(chunk[0]);
+      if(method == 1) n = spsc.dequeueBytes(chunk, sizeof(chunk));
+      if(method == 2) {
+        std::lock_guard<std::mutex> lock(mutex);
+        n = try_dequeue_byte(locked, chunk[0]);
+      }
+      if(n == 0) std::this_thread::yield();
+      received += n;
+    }
+    producer.join();
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    printf("%-14s %8.1f MB/s\n", names[method],
+           received / elapsed.count() / 1e6);
+    destroy_queue(locked);
+  }
+}
+
+// Passes 8-byte messages from 2 to 32 producer threads to one consumer
+// thread through MpscByteQueue, and through a queue guarded by a mutex
+void benchmarkMpsc() {
+  const size_t total = 4000000;
+  const char* names[] = {"mpsc", "mutex"};
+  for(int numProducers = 2; numProducers <= 32; numProducers *= 2) {
+    for(int method = 0; method < 2; ++method) {
+      MpscByteQueue mpsc;
+      ByteQueueFragment* locked = nullptr;
+      std::mutex mutex;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> producers;
+      for(int i = 0; i < numProducers; ++i) {
+        producers.emplace_back([&] {
+          unsigned char message[8];
+          memset(message, 'x', sizeof(message));
+          size_t sent = 0;
+          while(sent < total / numProducers) {
+            size_t n = 0;
+            if(method == 0) n = mpsc.enqueueBytes(message, sizeof(message));
+            if(method == 1) {
+              std::lock_guard<std::mutex> lock(mutex);
+              if(enqueue_capacity(locked) >= sizeof(message)) {
+                enqueue_bytes(locked, message, sizeof(message));
+                n = sizeof(message);
+              }
+            }
+            if(n == 0) std::this_thread::yield();
+            sent += n;
+          }
+        });
+      }
+      unsigned char chunk[64];
+      size_t received = 0;
+      while(received < total / numProducers * numProducers) {
+        size_t n = 0;
+        if(method == 0) n = mpsc.dequeueBytes(chunk, sizeof(chunk));
+        if(method == 1) {
+          std::lock_guard<std::mutex> lock(mutex);
+          n = copy_out(locked, 0, sizeof(chunk), chunk);
+          skip(locked, n);
+        }
+        if(n == 0) std::this_thread::yield();
+        received += n;
+      }
+      for(std::thread& producer : producers) producer.join();
+      std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+      printf("%-6s %2d producers %8.1f MB/s\n", names[method], numProducers,
+             received / elapsed.count() / 1e6);
+      destroy_queue(locked);
+    }
+  }
+}
+
+// Passes bytes in 64-byte chunks from a producer thread to a consumer
+// thread through SpscByteQueue and through FragmentChannel
+void benchmarkChannel() {
+  const size_t total = 10000000;
+  const char* names[] = {"spsc bulk", "channel"};
+  for(int method = 0; method < 2; ++method) {
+    SpscByteQueue spsc;
+    FragmentChannel channel;
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&] {
+      unsigned char chunk[64];
+      memset(chunk, 'x', sizeof(chunk));
+      size_t sent = 0;
+      while(sent < total) {
+        size_t n = 0;
+        if(method == 0) n = spsc.enqueueBytes(chunk, sizeof(chunk));
+        if(method == 1) n = channel.send(chunk, sizeof(chunk));
+        if(n == 0) std::this_thread::yield();
+        sent += n;
+      }
+      if(method == 1) channel.flush();
+    });
+    unsigned char chunk[64];
+    size_t received = 0;
+    while(received < total) {
+      size_t n = 0;
+      if(method == 0) n = spsc.dequeueBytes(chunk, sizeof(chunk));
+      if(method == 1) n = channel.receive(chunk, sizeof(chunk));
+      if(n == 0) std::this_thread::yield();
+      received += n;
+    }
+    producer.join();
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    printf("%-14s %8.1f MB/s\n", names[method],
+           received / elapsed.count() / 1e6);
+  }
+}
+
+// Measures how long a consumer sleeping in dequeueWait() takes to wake
+// once a producer enqueues a byte
+void benchmarkWakeLatency() {
+  const int rounds = 200;
+  SpscByteQueue queue;
+  std::atomic<int64_t> sentAt(0);
+  std::thread producer([&] {
+    for(int round = 0; round < rounds; ++round) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+      sentAt.store(now.time_since_epoch().count());
+      queue.enqueue('x');
+    }
+  });
+  std::chrono::nanoseconds total(0);
+  for(int round = 0; round < rounds; ++round) {
+    unsigned char byte;
+    if(!queue.dequeueWait(byte, std::chrono::seconds(1))) break;
+    total += std::chrono::steady_clock::now().time_since_epoch() -
+      std::chrono::steady_clock::duration(sentAt.load());
+  }
+  producer.join();
+  printf("wake latency   %8.1f us\n", total.count() / rounds / 1e3);
+}
+
+#ifdef __linux__
+// Drains 32 queues fed by 4 producer threads from one thread, woken by
+// eventfds through epoll, and by polling every queue. Reports throughput
+// and the CPU time the draining thread used.
+void benchmarkReadableEvents() {
+  const int numQueues = 32;
+  const int numProducers = 4;
+  const size_t bytesPerQueue = 16000;
+  const char* names[] = {"eventfd", "polling"};
+  for(int method = 0; method < 2; ++method) {
+    SpscByteQueue queues[numQueues];
+    int epfd = epoll_create1(0);
+    int eventFds[numQueues];
+    for(int i = 0; i < numQueues; ++i) {
+      eventFds[i] = eventfd(0, EFD_NONBLOCK);
+      queues[i].setReadableEventFd(eventFds[i]);
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u32 = i;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, eventFds[i], &event);
+      queues[i].armReadableEvent();
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for(int p = 0; p < numProducers; ++p) {
+      producers.emplace_back([&, p] {
+        unsigned char burst[16];
+        memset(burst, 'x', sizeof(burst));
+        size_t sent[numQueues] = {};
+        for(size_t round = 0; round < bytesPerQueue; round += sizeof(burst)) {
+          for(int i = p; i < numQueues; i += numProducers) {
+            while(sent[i] <= round) {
+              sent[i] += queues[i].enqueueBytes(burst, sizeof(burst));
+              if(sent[i] <= round) std::this_thread::yield();
+            }
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+      });
+    }
+    timespec cpuStart, cpuEnd;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+    unsigned char chunk[256];
+    size_t received = 0;
+    while(received < numQueues * bytesPerQueue) {
+      if(method == 0) {
+        struct epoll_event events[numQueues];
+        int numEvents = epoll_wait(epfd, events, numQueues, 100);
+        for(int e = 0; e < numEvents; ++e) {
+          int i = events[e].data.u32;
+          eventfd_t count;
+          eventfd_read(eventFds[i], &count);
+          do {
+            while(size_t n = queues[i].dequeueBytes(chunk, sizeof(chunk))) {
+              received += n;
+            }
+          } while(!queues[i].armReadableEvent());
+        }
+      }
+      if(method == 1) {
+        size_t found = 0;
+        for(int i = 0; i < numQueues; ++i) {
+          found += queues[i].dequeueBytes(chunk, sizeof(chunk));
+        }
+        if(found == 0) std::this_thread::yield();
+        received += found;
+      }
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    for(std::thread& producer : producers) producer.join();
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    double cpu = (cpuEnd.tv_sec - cpuStart.tv_sec) +
+      (cpuEnd.tv_nsec - cpuStart.tv_nsec) / 1e9;
+    printf("%-14s %8.1f MB/s %6.0f ms cpu\n", names[method],
+           received / elapsed.count() / 1e6, cpu * 1e3);
+    for(int i = 0; i < numQueues; ++i) close(eventFds[i]);
+    close(epfd);
+  }
+}
+#endif
+
+// Passes 100-byte messages with a 1-byte length prefix between two
+// coroutines through a queue
+Task writeMessages(ByteQueue& queue, int count) {
+  unsigned char message[101];
+  message[0] = 100;
+  memset(message + 1, 'x', 100);
+  for(int i = 0; i < count; ++i) {
+    co_await queue.write(ByteSpan{message, sizeof(message)});
+  }
+}
+
+Task readMessages(ByteQueue& queue, int count, size_t& received) {
+  for(int i = 0; i < count; ++i) {
+    std::vector<unsigned char> length = co_await queue.read(1);
+    std::vector<unsigned char> payload = co_await queue.read(length[0]);
+    received += payload.size();
+  }
+}
+
+void benchmarkCoroutines() {
+  const int count = 1000000;
+  ByteQueue queue;
+  size_t received = 0;
+  Executor executor;
+  auto start = std::chrono::steady_clock::now();
+  executor.spawn(writeMessages(queue, count));
+  executor.spawn(readMessages(queue, count, received));
+  executor.run();
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  printf("coroutines     %8.1f MB/s\n", received / elapsed.count() / 1e6);
+}
+
+// Drains 32 queues fed by 4 producer threads with 1 to 8 workers,
+// computing a CRC-32C of each queue's bytes
+void benchmarkDrainExecutor() {
+  const int numQueues = 32;
+  const int numProducers = 4;
+  const size_t bytesPerQueue = 200000;
+  for(int numWorkers = 1; numWorkers <= 8; numWorkers *= 2) {
+    SpscByteQueue queues[numQueues];
+    struct Sink {
+      uint32_t crc[numQueues];
+      std::atomic<size_t> received;
+    } sink = {};
+    DrainExecutor executor(
+      [](int slot, const unsigned char* data, size_t len, void* context) {
+        Sink* sink = static_cast<Sink*>(context);
+        sink->crc[slot] = crc32c_update(sink->crc[slot], data, len);
+        sink->received.fetch_add(len, std::memory_order_relaxed);
+      }, &sink);
+    for(int i = 0; i < numQueues; ++i) executor.attach(queues[i]);
+    auto start = std::chrono::steady_clock::now();
+    executor.start(numWorkers);
+    std::vector<std::thread> producers;
+    for(int p = 0; p < numProducers; ++p) {
+      producers.emplace_back([&, p] {
+        unsigned char burst[64];
+        memset(burst, 'x', sizeof(burst));
+        size_t sent[numQueues] = {};
+        for(size_t round = 0; round < bytesPerQueue; round += sizeof(burst)) {
+          for(int i = p; i < numQueues; i += numProducers) {
+            while(sent[i] < round + sizeof(burst)) {
+              size_t missing = round + sizeof(burst) - sent[i];
+              size_t n = queues[i].enqueueBytes(burst, missing);
+              sent[i] += n;
+              if(n > 0) executor.notify(i);
+              else std::this_thread::yield();
+            }
+          }
+        }
+      });
+    }
+    for(std::thread& producer : producers) producer.join();
+    while(sink.received.load() < numQueues * bytesPerQueue) {
+      std::this_thread::yield();
+    }
+    executor.stop();
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    printf("%d workers      %8.1f MB/s\n", numWorkers,
+           sink.received.load() / elapsed.count() / 1e6);
+  }
+}
+
+#ifdef __linux__
+// Passes bytes in 64-byte chunks from a parent process to a forked child
+// through a SharedQueue, the child reading them in place with peek()
+void benchmarkSharedQueue() {
+  const size_t total = 10000000;
+  int fd;
+  SharedQueue* shared = create_shared_queue(fd);
+  if(shared == nullptr) return;
+  auto start = std::chrono::steady_clock::now();
+  pid_t child = fork();
+  if(child == 0) {
+    SharedQueue* consumer = open_shared_queue(fd);
+    size_t received = 0;
+    uint32_t crc = 0;
+    while(received < total) {
+      ByteSpan span = consumer->queue.peek();
+      if(span.len == 0) {
+        std::this_thread::yield();
+        continue;
+      }
+      crc = crc32c_update(crc, span.data, span.len);
+      consumer->queue.consume(span.len);
+      received += span.len;
+    }
+    close_shared_queue(consumer);
+    _exit(0);
+  }
+  unsigned char chunk[64];
+  memset(chunk, 'x', sizeof(chunk));
+  size_t sent = 0;
+  while(sent < total) {
+    size_t n = shared->queue.enqueueBytes(chunk, sizeof(chunk));
+    if(n == 0) std::this_thread::yield();
+    sent += n;
+  }
+  waitpid(child, nullptr, 0);
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  printf("shared queue   %8.1f MB/s\n", total / elapsed.count() / 1e6);
+  close_shared_queue(shared);
+  close(fd);
+}
+#endif
+
+// Passes bytes through an SpscByteQueue while 0 to 2 reader threads peek
+// at them in place, pinned to an EpochReclaimer, and reports the
+// consumer's throughput and the readers' peeks
+void benchmarkConcurrentPeek() {
+  const size_t total = 10000000;
+  for(int numReaders = 0; numReaders <= 2; ++numReaders) {
+    SpscByteQueue queue;
+    EpochReclaimer reclaimer;
+    queue.setReclaimer(&reclaimer);
+    std::atomic<bool> isDone(false);
+    std::atomic<size_t> peeks(0);
+    std::vector<std::thread> readers;
+    for(int r = 0; r < numReaders; ++r) {
+      readers.emplace_back([&] {
+        int reader = reclaimer.addReader();
+        ByteSpan spans[8];
+        uint32_t crc = 0;
+        while(!isDone.load(std::memory_order_relaxed)) {
+          reclaimer.pin(reader);
+          size_t numSpans = queue.peekSpans(spans, 8);
+          for(size_t i = 0; i < numSpans; ++i) {
+            crc = crc32c_update(crc, spans[i].data, spans[i].len);
+          }
+          reclaimer.unpin(reader);
+          peeks.fetch_add(1, std::memory_order_relaxed);
+          std::this_thread::yield();
+        }
+      });
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&] {
+      unsigned char chunk[64];
+      memset(chunk, 'x', sizeof(chunk));
+      size_t sent = 0;
+      while(sent < total) {
+        size_t n = queue.enqueueBytes(chunk, sizeof(chunk));
+        if(n == 0) std::this_thread::yield();
+        sent += n;
+      }
+    });
+    unsigned char chunk[64];
+    size_t received = 0;
+    while(received < total) {
+      size_t n = queue.dequeueBytes(chunk, sizeof(chunk));
+      if(n == 0) {
+        reclaimer.reclaim();
+        std::this_thread::yield();
+      }
+      received += n;
+    }
+    producer.join();
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    isDone.store(true);
+    for(std::thread& reader : readers) reader.join();
+    printf("%d readers      %8.1f MB/s %8zu peeks\n", numReaders,
+           received / elapsed.count() / 1e6, peeks.load());
+  }
+}
+
+// Has 1 to 8 threads each enqueue and dequeue through a queue of its own,
+// locking it with its own spinlock, and for comparison, locking all
+// queues with one mutex
+void benchmarkLockedQueues() {
+  const size_t bytesPerThread = 4000000;
+  const char* names[] = {"spinlock", "global mutex"};
+  for(int numThreads = 1; numThreads <= 8; numThreads *= 2) {
+    for(int method = 0; method < 2; ++method) {
+      LockedByteQueue lockedQueues[8];
+      ByteQueueFragment* fronts[8] = {};
+      std::mutex mutex;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for(int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t] {
+          unsigned char chunk[64];
+          memset(chunk, 'x', sizeof(chunk));
+          for(size_t done = 0; done < bytesPerThread; done += sizeof(chunk)) {
+            if(method == 0) {
+              lockedQueues[t].enqueueBytes(chunk, sizeof(chunk));
+              lockedQueues[t].dequeueBytes(chunk, sizeof(chunk));
+            }
+            if(method == 1) {
+              std::lock_guard<std::mutex> lock(mutex);
+              enqueue_bytes(fronts[t], chunk, sizeof(chunk));
+              skip(fronts[t], copy_out(fronts[t], 0, sizeof(chunk), chunk));
+            }
+          }
+        });
+      }
+      for(std::thread& thread : threads) thread.join();
+      std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+      printf("%d threads %-12s %8.1f MB/s\n", numThreads, names[method],
+             numThreads * bytesPerThread / elapsed.count() / 1e6);
+      for(int t = 0; t < 8; ++t) destroy_queue(fronts[t]);
     }
-    std::cout << '\n';
   }
 }
 
 /***********/
-/* M A I N */ 
+/* M A I N */
 /***********/
 
 int main() {
@@ -510,5 +4842,17 @@ int main() {
   printf("%d\n", dequeue_byte(q1));
   destroy_queue(q1);
   //printDataBlock();
+  //benchmarkIoEngines();
+  //benchmarkTransfer();
+  //benchmarkSpsc();
+  //benchmarkMpsc();
+  //benchmarkChannel();
+  //benchmarkWakeLatency();
+  //benchmarkReadableEvents();
+  //benchmarkCoroutines();
+  //benchmarkDrainExecutor();
+  //benchmarkSharedQueue();
+  //benchmarkConcurrentPeek();
+  //benchmarkLockedQueues();
   return 0;
 }